@@ -151,17 +151,70 @@ class OpticalFlowNode: public BaseNode, public ImageTransceiver, public MultiRec
 			      match_status, err );
 
 
+    _FeatureVector velocity_vectors;
+    
+    _FeatureVector::const_iterator matched_it = matched_features.begin();
+    _StatusVector::const_iterator status_it = match_status.begin();
+
+    for( _FeatureVector::const_iterator previous_it = prev_features_.begin();
+	 previous_it != prev_features_.end(); 
+	 ++previous_it, ++matched_it, ++status_it )
+      {
+	if( *status_it )
+	  velocity_vectors.push_back( *matched_it - *previous_it );
+      }
+
     // ################################################################
-    // Draw output image and publish ##################################
+    // Do RANSAC ######################################################
     // ################################################################
-    _FeatureVector velocity_vectors;
+
+    _FeatureVector ransac_vectors;
+    double ransac_mse;
+    cv::Point2f ransac_velocity;
     
+    bool const ransac_success = !RANSAC( velocity_vectors, ransac_vectors, ransac_mse, ransac_velocity );
+    if( !ransac_success )
+      ROS_DEBUG("RANSAC failed.");
+    else
+      ROS_DEBUG("RANSAC: ( %.4f, %.4f ) with MSE %.4f. In: %lu, Out: %lu.",
+		ransac_velocity.x, ransac_velocity.y, ransac_mse,
+		velocity_vectors.size(), ransac_vectors.size() );
+
+    // ################################################################
+    // Draw output image and publish ##################################
+    // ################################################################
+
+    /// Only drawn when someone is subscribed
+    publishImageLazy( "image_debug", [&]()
+		      {
+			return renderDebugImage( msg->header, new_image, matched_features, match_status, feature_radius,
+						 ransac_success, ransac_velocity, ransac_mse );
+		      } );
+
+    /// update previous frame
+    new_image.copyTo( prev_image_ );
+    prev_features_ = new_features;
+
+    return;
+  }
+  
+  /** 
+   * Draw the tracked features, their motion, and the RANSAC estimate over the current frame
+   * 
+   * @param image Current frame, mono8
+   * @param matched_features Where each of prev_features_ ended up in image
+   * @param match_status Nonzero for each feature that was tracked
+   */
+  _CvImage::ConstPtr renderDebugImage( std_msgs::Header const & header, cv::Mat const & image, 
+				       _FeatureVector const & matched_features, _StatusVector const & match_status,
+				       unsigned int const & feature_radius, bool const & ransac_success,
+				       cv::Point2f const & ransac_velocity, double const & ransac_mse )
+  {
     cv_bridge::CvImage::Ptr output = 
       boost::make_shared<cv_bridge::CvImage>
-      ( msg->header, sensor_msgs::image_encodings::BGR8 );
+      ( header, sensor_msgs::image_encodings::BGR8 );
 
-    /// this function can process the image in place
-    cv::cvtColor( new_image, output->image, CV_GRAY2BGR );
+    cv::cvtColor( image, output->image, CV_GRAY2BGR );
 
     cv::Size output_size = output->image.size();
     
@@ -188,22 +241,12 @@ class OpticalFlowNode: public BaseNode, public ImageTransceiver, public MultiRec
 	cv::circle( output->image, *previous_it,
 		    feature_radius, uscauv::CV_DENIM_BGR, 2);
 	
-	velocity_vectors.push_back( *matched_it - *previous_it );
-
 	/// ray between estimate and original feature
 	cv::line( output->image, *previous_it, *matched_it,
 		  cv::Scalar(200, 200, 200), 1);
 	
       }
 
-    // ################################################################
-    // Do RANSAC ######################################################
-    // ################################################################
-
-    _FeatureVector ransac_vectors;
-    double ransac_mse;
-    cv::Point2f ransac_velocity;
-    
     /// text params
     std::string const status_text = "RANSAC: ";
     int const font = cv::FONT_HERSHEY_SIMPLEX;
@@ -218,9 +261,8 @@ class OpticalFlowNode: public BaseNode, public ImageTransceiver, public MultiRec
 		 font, font_scale, uscauv::CV_GREEN_BGR,
 		 font_thickness );
     
-    if( RANSAC( velocity_vectors, ransac_vectors, ransac_mse, ransac_velocity ))
+    if( !ransac_success )
       {
-	ROS_DEBUG("RANSAC failed.");
 	cv::putText( output->image, "Failure", text_origin + cv::Point( status_size.width, 0), 
 		     font, font_scale, uscauv::CV_RED_BGR,
 		     font_thickness );
@@ -232,9 +274,6 @@ class OpticalFlowNode: public BaseNode, public ImageTransceiver, public MultiRec
 	vel << "Velocity: (" << ransac_velocity.x << ", " << ransac_velocity.y << ")";
 	mse << "MSE: " << ransac_mse;
 
-	ROS_DEBUG("RANSAC: ( %.4f, %.4f ) with MSE %.4f. In: %lu, Out: %lu.",
-		 ransac_velocity.x, ransac_velocity.y, ransac_mse,
-		 velocity_vectors.size(), ransac_vectors.size() );
 	cv::putText( output->image, "Good", text_origin + cv::Point( status_size.width, 0), 
 		     font, font_scale, uscauv::CV_GREEN_BGR,
 		     font_thickness );
@@ -250,15 +289,9 @@ class OpticalFlowNode: public BaseNode, public ImageTransceiver, public MultiRec
     cv::line( output->image, output_center, ransac_velocity + output_center,
 	      uscauv::CV_GREEN_BGR, 3);
 
-    publishImage( "image_debug", output );
-
-    /// update previous frame
-    new_image.copyTo( prev_image_ );
-    prev_features_ = new_features;
-
-    return;
+    return output;
   }
-  
+
   int RANSAC( _FeatureVector const & in, _FeatureVector & out, 
 	       double & error, cv::Point2f & model )
   {
@@ -52,16 +52,26 @@
 /// xmlrpcpp
 #include <XmlRpcValue.h>
 
+/// ROS messages
+#include <std_msgs/UInt64.h>
+
 /// cpp11
+#include <functional>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
 
 /// uscauv
 #include <uscauv_common/color_codec.h>
 #include <uscauv_common/param_loader.h>
 #include <uscauv_common/tic_toc.h>
+#include <uscauv_common/worker_pool.h>
+#include <uscauv_common/region_scheduler.h>
+
+/// color_classification
+#include <color_classification/color_lookup_table.h>
+#include <color_classification/color_model_cache.h>
+#include <color_classification/color_features.h>
 
 std::string const COLOR_NS = "model/colors";
 std::string const COMPOSITES_NAME = "composites";
@@ -69,46 +79,95 @@ std::string const COMPOSITES_NS = COLOR_NS + "/" + COMPOSITES_NAME;
 
 typedef std::map<std::string, image_transport::Publisher> _ColorPublisherMap;
 
-struct ClassifyThreadStorage
-{
-  typedef std::shared_ptr<ClassifyThreadStorage> Ptr;
-  typedef std::shared_ptr<ClassifyThreadStorage const> ConstPtr;
-  
-  enum class State{ READY, PROCESSED };
-  State state_;
-
-  std::condition_variable cv_;
-  std::mutex m_;
+typedef ColorLookupTable::_EncodedType _EncodedType;
 
-  cv::Mat input_, output_;
+struct ColorStorage
+{
+  typedef std::shared_ptr<ColorStorage> Ptr;
+  typedef std::shared_ptr<ColorStorage const> ConstPtr;
 
   /// cv::SVM doesn't have proper copy assignment
   cv::SVM svm_;
+
+  /// Index of the bit that represents this color in the encoded image
+  unsigned int bit_;
+
+  /// Decision of svm_ over the whole feature space, only used in lookup table mode
+  cv::Mat decision_;
+
+  /// If decision_ came from the model cache, this keeps it mapped
+  ColorModelCache::Ptr cache_;
+  
+  ColorStorage(): bit_(0) {}
+};
+
+/// Everything that belongs to one camera. The models and the worker pool are shared between cameras.
+struct CameraStream
+{
+  typedef std::shared_ptr<CameraStream> Ptr;
+
+  /// Empty for the unnamed camera, whose topics live directly in the node's namespace
+  std::string name_;
+  
+  ros::NodeHandle nh_;
+  image_transport::ImageTransport image_transport_;
+  image_transport::Subscriber image_sub_;
+  _ColorPublisherMap classified_image_pub_;
+  uscauv::EncodedColorPublisher encoded_image_pub_;
+  ros::Publisher dropped_frames_pub_;
+  /// Decides when to classify only the regions that the object tracker predicts
+  uscauv::RegionScheduler region_scheduler_;
+
+  /// Guarded by the node's frame mutex
+  sensor_msgs::ImageConstPtr pending_frame_;
+  uint64_t dropped_frames_;
+
+  /// Only touched by the processing thread, reused between frames
+  cv::Mat features_, encoded_;
+  /// Coarse-to-fine buffers
+  cv::Mat coarse_features_, coarse_encoded_, candidates_;
+  std::vector<cv::Rect> candidate_blocks_, tracker_regions_;
   
-  ClassifyThreadStorage(){ state_ = State::PROCESSED; }
+ CameraStream( ros::NodeHandle const & nh, std::string const & name ):
+  name_( name ), nh_( nh ), image_transport_( nh ), dropped_frames_( 0 ) {}
 };
 
-typedef std::map<std::string, ClassifyThreadStorage::Ptr > _ColorThreadMap;
+typedef std::map<std::string, ColorStorage::Ptr > _ColorStorageMap;
 typedef std::vector< std::string > _CompositeColor;
 typedef std::map<std::string, _CompositeColor> _CompositeColorMap;
+/// ( mask of all component color bits, composite color bit )
+typedef std::vector<std::pair<_EncodedType, _EncodedType> > _CompositeMaskArray;
 
 class ColorClassifierNode
 {
  private:
   /// publishers and subscribers
   ros::NodeHandle nh_rel_;
-  image_transport::ImageTransport image_transport_;
-  image_transport::Subscriber image_sub_;
-  _ColorPublisherMap classified_image_pub_;
-  _ColorThreadMap thread_storage_;
+  _ColorStorageMap color_storage_;
   _CompositeColorMap composite_colors_;
-  uscauv::EncodedColorPublisher encoded_image_pub_;  
+  _CompositeMaskArray composite_masks_;
+  std::vector<CameraStream::Ptr> cameras_;
 
   /// parameters
   double loop_rate_hz_;
+  bool use_lookup_table_;
+  std::string model_cache_dir_;
+  color_features::FeatureSpace feature_space_;
+  int coarse_factor_;
+  int coarse_dilation_;
   
   /// color classification
   std::vector<std::string> color_names_;
+  ColorLookupTable lookup_table_;
+  std::shared_ptr<uscauv::WorkerPool> worker_pool_;
+
+  /// pipeline. imageCallback only hands frames off, so receiving frame N+1 overlaps classifying frame N.
+  std::thread processing_thread_;
+  std::mutex frame_mutex_;
+  std::condition_variable frame_cv_;
+  bool running_;
+  /// Camera that gets the first look for a pending frame next time, so that a fast camera can't starve a slow one
+  unsigned int next_camera_;
   
  public:
 
@@ -119,83 +178,58 @@ class ColorClassifierNode
  ColorClassifierNode()
    :
   nh_rel_("~"),
-    image_transport_( nh_rel_ )
+    feature_space_( color_features::FeatureSpace::HS ),
+    coarse_factor_( 1 ),
+    coarse_dilation_( 1 ),
+    running_( false ),
+    next_camera_( 0 )
     {}
-    
- private:
-    
-  /// Spawn one thread that runs this function per color definition
-  void classifyThread(ClassifyThreadStorage::Ptr storage)
-  {
-    while(true)
-      {
-      
-	/// Wait for the main thread to signal that the image is ready for processing
-	{
-	  std::unique_lock<std::mutex> lock( storage->m_ );
-	  storage->cv_.wait( lock, [&]{ return storage->state_ == ClassifyThreadStorage::State::READY; });
-	}
-	  
-	unsigned int match_count = 0;
 
-	cv::Mat input_image = storage->input_;
-
-	/// convert to HSV
-	cv::cvtColor(input_image, input_image, CV_BGR2HSV);
-    
-	cv::Mat input_hs( input_image.rows, input_image.cols, CV_8UC2 ), input_v( input_image.rows, input_image.cols, CV_8UC1 );
-	cv::Mat mix_out[] { input_hs, input_v };
-	int from_to[] = { 0,0, 1,1, 2,2 };
-	cv::mixChannels( &input_image, 1, mix_out, 2, from_to, 3);
-    
-	cv::Mat input_float;
-	input_hs.convertTo( input_float, CV_32F );
+  ~ColorClassifierNode()
+  {
+    {
+      std::lock_guard<std::mutex> lock( frame_mutex_ );
+      running_ = false;
+    }
+    frame_cv_.notify_all();
+
+    if( processing_thread_.joinable() )
+      processing_thread_.join();
+  }
     
-	cv::Mat classified_image = cv::Mat( input_image.size(), CV_8UC1 );
+ private:
     
-	/// Classify the input image.
-	cv::MatIterator_<unsigned char> cl_it = classified_image.begin<unsigned char>();
-	cv::MatConstIterator_<cv::Vec2f> in_it = input_float.begin<cv::Vec2f>();
-  
-	for(; in_it != input_float.end<cv::Vec2f>(); ++in_it, ++cl_it)
-	  {
-	    float response = storage->svm_.predict( cv::Mat(*in_it) );
-	      
-	    if ( response == -1.0)
-	      *cl_it = 0;
-	    else if ( response == 1.0 )
-	      {
-		*cl_it = 255;
-		++match_count;
-	      }
-	    else
-	      {
-		ROS_WARN( "SVM has incorrect output format. Image will not be classifed. Valid output: {-1, 1}");
-		/* return -1; */
-	      }
-	  }
-
-	storage->output_ = classified_image;
-	  
-	/* ROS_DEBUG("[ %s ] SVM matched %d pixels. ", color_name.c_str(),match_count); */
-	  
-	/// Notify the main thread that processing is complete
-	{
-	  std::lock_guard<std::mutex> lock( storage->m_ );
-	  storage->state_ = ClassifyThreadStorage::State::PROCESSED;
-	}
-	storage->cv_.notify_one();
-
-      }
-    return;
-  }
-  
   /// Running spin() will cause this function to be called before the node begins looping the spingOnce() function.
   void spinFirst()
   {
     /// Get ROS ready ------------------------------------
     ros::NodeHandle nh;
-    image_transport_ = image_transport::ImageTransport( nh_rel_ );
+
+    /// Must match the feature space that the SVMs were trained in. "uv" reads chroma straight out of packed YUV422 images.
+    std::string const feature_space_name = uscauv::param::load<std::string>( nh_rel_, "feature_space", "hs" );
+    if( color_features::parseFeatureSpace( feature_space_name, feature_space_ ) )
+      {
+	ROS_FATAL( "Invalid feature space [ %s ]. Valid feature spaces: { hs, uv }", feature_space_name.c_str() );
+	ros::shutdown();
+	return;
+      }
+    
+    /// If this is set, every SVM is evaluated once over the whole feature space at startup instead of once per pixel per frame
+    use_lookup_table_ = uscauv::param::load<bool>( nh_rel_, "lookup_table", true );
+
+    /// If greater than 1, every coarse_factor-th pixel in each direction is classified first, and only the blocks around
+    /// hits (grown by coarse_dilation blocks) are classified at full resolution. Objects smaller than the factor can be missed.
+    coarse_factor_ = std::max( 1, uscauv::param::load<int>( nh_rel_, "coarse_factor", 1 ) );
+    coarse_dilation_ = std::max( 0, uscauv::param::load<int>( nh_rel_, "coarse_dilation", 1 ) );
+    if( coarse_factor_ > 1 && coarse_factor_ % 2 )
+      {
+	/// Keeps full resolution blocks aligned with YUV422 pixel pairs
+	ROS_WARN( "Coarse factor must be even. Using [ %d ].", coarse_factor_ + 1 );
+	++coarse_factor_;
+      }
+
+    /// Compiled SVMs are stored here, keyed by a hash of their YAML definitions. Set to "" to disable the cache.
+    model_cache_dir_ = uscauv::param::load<std::string>( nh_rel_, "model_cache", getDefaultCacheDir() );
     
     /// Load SVMs ------------------------------------
     XmlRpc::XmlRpcValue xml_colors = uscauv::param::load<XmlRpc::XmlRpcValue>( nh, COLOR_NS );
@@ -206,7 +240,7 @@ class ColorClassifierNode
 	if( color_it->first == COMPOSITES_NAME )
 	  continue;
 	
-	ClassifyThreadStorage::Ptr storage = std::make_shared<ClassifyThreadStorage>();
+	ColorStorage::Ptr storage = std::make_shared<ColorStorage>();
 	
 	std::string color_name, color_path;
 	
@@ -225,52 +259,48 @@ class ColorClassifierNode
 	    continue;
 	  }
 		
-	/// File I/O datatypes
-	/* std::shared_ptr<cv::SVM> color_svm = std::make_shared<cv::SVM>(); */
-	CvFileStorage * svm_storage = NULL;
-	CvFileNode * svm_node =       NULL;
-	
-	/// Open file storage
-	svm_storage = cvOpenFileStorage(color_path.c_str(), NULL, CV_STORAGE_READ);
-	if (svm_storage == NULL)
+	/// The lookup table only needs each SVM's decision table, which we can map straight out of the model cache
+	uint64_t source_hash = 0;
+	bool const use_cache = use_lookup_table_ && !model_cache_dir_.empty() &&
+	  !ColorModelCache::hashFile( color_path, source_hash );
+	std::string const cache_path = ColorModelCache::getCachePath( model_cache_dir_, color_name, source_hash );
+
+	if( use_cache )
 	  {
-	    ROS_WARN( "Failed to open SVM. [ %s ] [ %s ]", color_name.c_str(), color_path.c_str() );
-	    continue;
+	    ColorModelCache::Ptr cache = std::make_shared<ColorModelCache>();
+	    if( !cache->open( cache_path, source_hash ) )
+	      {
+		storage->cache_ = cache;
+		storage->decision_ = cache->getDecisionTable();
+		ROS_INFO( "Loaded compiled SVM from cache. [ %s ] [ %s ]", color_name.c_str(), cache_path.c_str() );
+	      }
 	  }
 
-	/// Search for a yaml node with the name of the color from the highest level.
-	svm_node = cvGetFileNodeByName( svm_storage, NULL, color_name.c_str() );
-	if (svm_node == NULL)
+	/// Cache miss, stale cache, or SVM mode
+	if( storage->decision_.empty() )
 	  {
-	    ROS_WARN( "Failed to find SVM file node. [ %s ]", color_name.c_str() );
-	    continue;
+	    if( loadSVM( color_name, color_path, storage->svm_ ) )
+	      continue;
+
+	    if( use_lookup_table_ && ColorLookupTable::evaluateSVM( storage->svm_, storage->decision_ ) )
+	      {
+		ROS_WARN( "Failed to evaluate SVM. [ %s ]", color_name.c_str() );
+		continue;
+	      }
+	    
+	    if( use_cache )
+	      {
+		if( ColorModelCache::write( model_cache_dir_, color_name, source_hash, storage->decision_ ) )
+		  ROS_WARN( "Failed to write model cache. [ %s ] [ %s ]", color_name.c_str(), cache_path.c_str() );
+		else
+		  ROS_INFO( "Wrote model cache. [ %s ] [ %s ]", color_name.c_str(), cache_path.c_str() );
+	      }
 	  }
-	
-	/// populate the fields the the cv::SVM
-	storage->svm_.read( svm_storage, svm_node );
-	
-	cvReleaseFileStorage( &svm_storage );
 
-	thread_storage_[ color_name ] = storage;
-	std::thread classify_thread( &ColorClassifierNode::classifyThread, this, 
-				     thread_storage_[ color_name ] );
-	classify_thread.detach();
+	color_storage_[ color_name ] = storage;
 	
 	++color_count;
 	ROS_INFO( "Loaded SVM successfully. [ %s ]", color_name.c_str() );
-
-    	ROS_INFO( "Creating publisher... [ %s ]", color_name.c_str() );
-	
-    	image_transport::Publisher color_pub;
-	
-    	/// We will publish each color classified image to a topic called <color_name>_classified.
-    	color_pub = image_transport_.advertise( color_name + "_classified", 1);
-	
-    	classified_image_pub_[ color_name ] = color_pub;
-	
-    	ROS_INFO( "Created publisher successfully." );
-	
-	
       }
 	
     if( !color_count )
@@ -291,7 +321,7 @@ class ColorClassifierNode
 	std::string bad_color;
 	for( _CompositeColor::value_type const & color : composite.second )
 	  {
-	    if( thread_storage_.find( color ) == thread_storage_.end() )
+	    if( color_storage_.find( color ) == color_storage_.end() )
 	      {
 		bad_color = color;
 		break;
@@ -309,16 +339,202 @@ class ColorClassifierNode
 
     composite_colors_ = verified_composite_colors;
 
+    if( assignColorBits() )
+      {
+	ROS_FATAL( "Failed to assign encoded color bits." );
+	ros::shutdown();
+	return;
+      }
+
+    // Build lookup table ###########################################
+
+    if( use_lookup_table_ && buildLookupTable() )
+      {
+	ROS_FATAL( "Failed to build color lookup table." );
+	ros::shutdown();
+	return;
+      }
+
+    // Start workers ##################################################
+
+    /// Every frame is split into row tiles that are classified on this pool, so it is sized to the hardware rather than to the number of colors or cameras
+    int threads = uscauv::param::load<int>( nh_rel_, "threads", 0 );
+    if( threads < 0 )
+      {
+	ROS_WARN( "Thread count must be non-negative. Got [ %d ], using [ 0 ].", threads );
+	threads = 0;
+      }
+    worker_pool_ = std::make_shared<uscauv::WorkerPool>( threads );
+    ROS_INFO( "Classifying with [ %u ] worker threads.", worker_pool_->size() );
+
     // Start IO #######################################################
+
+    /// Each camera named here gets its own set of topics under ~<camera>/ (image_color, encoded, <color>_classified, ...).
+    /// If no cameras are given, there is a single camera whose topics are directly under ~.
+    std::vector<std::string> const camera_names = 
+      uscauv::param::load<std::vector<std::string> >( nh_rel_, "cameras", std::vector<std::string>() );
     
-    encoded_image_pub_.advertise( nh_rel_, "encoded", 1 );
-	  
-    image_sub_ = image_transport_.subscribe( "image_color", 1, &ColorClassifierNode::imageCallback, this);
+    if( camera_names.empty() )
+      cameras_.push_back( std::make_shared<CameraStream>( nh_rel_, "" ) );
+    for( std::string const & camera_name : camera_names )
+      cameras_.push_back( std::make_shared<CameraStream>( ros::NodeHandle( nh_rel_, camera_name ), camera_name ) );
+
+    /// dense, rle, or auto. Run-length encoding is far smaller for sparse masks; auto sends whichever is smaller each frame.
+    std::string const encoded_format_name = uscauv::param::load<std::string>( nh_rel_, "encoded_format", "auto" );
+    uscauv::EncodedColorPublisher::Format encoded_format;
+    if( uscauv::EncodedColorPublisher::parseFormat( encoded_format_name, encoded_format ) )
+      {
+	ROS_WARN( "Invalid encoded format [ %s ]. Valid formats: { dense, rle, auto }. Using auto.", encoded_format_name.c_str() );
+	encoded_format = uscauv::EncodedColorPublisher::Format::AUTO;
+      }
+
+    for( CameraStream::Ptr const & camera : cameras_ )
+      {
+	/// We will publish each color classified image to a topic called <color_name>_classified.
+	for( _ColorStorageMap::value_type const & color : color_storage_ )
+	  camera->classified_image_pub_[ color.first ] = camera->image_transport_.advertise( color.first + "_classified", 1 );
+	
+	camera->encoded_image_pub_.advertise( camera->nh_, "encoded", 1 );
+	camera->encoded_image_pub_.setFormat( encoded_format );
+	camera->dropped_frames_pub_ = camera->nh_.advertise<std_msgs::UInt64>( "dropped_frames", 1 );
+	camera->region_scheduler_.init( camera->nh_ );
+      }
+
+    running_ = true;
+    processing_thread_ = std::thread( &ColorClassifierNode::processingThread, this );
+
+    for( CameraStream::Ptr const & camera : cameras_ )
+      {
+	camera->image_sub_ = camera->image_transport_.subscribe
+	  ( "image_color", 1, [this, camera]( sensor_msgs::ImageConstPtr const & msg ){ imageCallback( *camera, msg ); } );
+	
+	if( !camera->name_.empty() )
+	  ROS_INFO( "Classifying camera [ %s ].", camera->name_.c_str() );
+      }
 
     ROS_INFO( "Finished spinning up." );
     return;
   }
 
+  /// $ROS_HOME/color_classification, where $ROS_HOME defaults to ~/.ros
+  static std::string getDefaultCacheDir()
+  {
+    char const * ros_home = getenv( "ROS_HOME" );
+    if( ros_home )
+      return std::string( ros_home ) + "/color_classification";
+
+    char const * home = getenv( "HOME" );
+    if( home )
+      return std::string( home ) + "/.ros/color_classification";
+
+    return "";
+  }
+
+  /** 
+   * Parse an SVM out of its YAML definition
+   * 
+   * @param color_name Name of the top level node in the YAML file
+   * @param color_path Path to the YAML file
+   * @param svm SVM to populate
+   * 
+   * @return 0 on success, -1 on failure
+   */
+  int loadSVM( std::string const & color_name, std::string const & color_path, cv::SVM & svm )
+  {
+    /// File I/O datatypes
+    CvFileStorage * svm_storage = NULL;
+    CvFileNode * svm_node =       NULL;
+	
+    /// Open file storage
+    svm_storage = cvOpenFileStorage(color_path.c_str(), NULL, CV_STORAGE_READ);
+    if (svm_storage == NULL)
+      {
+	ROS_WARN( "Failed to open SVM. [ %s ] [ %s ]", color_name.c_str(), color_path.c_str() );
+	return -1;
+      }
+
+    /// Search for a yaml node with the name of the color from the highest level.
+    svm_node = cvGetFileNodeByName( svm_storage, NULL, color_name.c_str() );
+    if (svm_node == NULL)
+      {
+	ROS_WARN( "Failed to find SVM file node. [ %s ]", color_name.c_str() );
+	cvReleaseFileStorage( &svm_storage );
+	return -1;
+      }
+	
+    /// populate the fields the the cv::SVM
+    svm.read( svm_storage, svm_node );
+
+    /// Models from before svm_trainer recorded its feature space were all trained on (H,S)
+    std::string const model_space = cvReadStringByName( svm_storage, NULL, "feature_space", "hs" );
+    if( model_space != color_features::getFeatureSpaceName( feature_space_ ) )
+      ROS_WARN( "SVM was trained in feature space [ %s ], but classifying in [ %s ]. [ %s ]", model_space.c_str(),
+		color_features::getFeatureSpaceName( feature_space_ ).c_str(), color_name.c_str() );
+	
+    cvReleaseFileStorage( &svm_storage );
+    return 0;
+  }
+
+  /**
+   * Assign one bit of the encoded image to each color and composite color. Colors come first,
+   * then composites, in the order that they are published in the encoded image's name list.
+   *
+   * @return 0 on success, -1 on failure
+   */
+  int assignColorBits()
+  {
+    if( color_storage_.size() + composite_colors_.size() > ColorLookupTable::MAX_COLORS )
+      {
+	ROS_ERROR( "At most %d colors are supported, but [ %lu ] colors and composites were loaded.",
+		   ColorLookupTable::MAX_COLORS, color_storage_.size() + composite_colors_.size() );
+	return -1;
+      }
+
+    color_names_.clear();
+    composite_masks_.clear();
+
+    for( _ColorStorageMap::value_type & color : color_storage_ )
+      {
+	color.second->bit_ = color_names_.size();
+	color_names_.push_back( color.first );
+      }
+
+    for( _CompositeColorMap::value_type const & composite : composite_colors_ )
+      {
+	_EncodedType component_mask = 0;
+	for( _CompositeColor::value_type const & color : composite.second )
+	  component_mask |= _EncodedType(1) << color_storage_[ color ]->bit_;
+
+	composite_masks_.push_back( std::make_pair( component_mask, _EncodedType(1) << color_names_.size() ) );
+	color_names_.push_back( composite.first );
+      }
+
+    return 0;
+  }
+
+  /**
+   * Bake the decision table of every loaded SVM, along with the composite colors, into lookup_table_.
+   *
+   * @return 0 on success, -1 on failure
+   */
+  int buildLookupTable()
+  {
+    ROS_INFO( "Building color lookup table..." );
+
+    lookup_table_.reset( color_names_.size() );
+
+    for( _ColorStorageMap::value_type const & color : color_storage_ )
+      {
+	lookup_table_.addDecisionTable( color.second->decision_, color.second->bit_ );
+      }
+
+    for( _CompositeMaskArray::value_type const & composite : composite_masks_ )
+      lookup_table_.addComposite( composite.first, composite.second );
+
+    ROS_INFO( "Built lookup table with [ %lu ] colors.", color_names_.size() );
+    return 0;
+  }
+
   /// Running spin() will cause this function to get called at the loop rate until this node is killed.
   void spinOnce()
   {
@@ -355,89 +571,365 @@ class ColorClassifierNode
  private:
 
   /** 
-   * For each color, classify the incoming image and publish the results
+   * Hand the incoming image to the processing thread. If the processing thread hasn't picked up the
+   * previous image yet, that image is stale and gets replaced, so latency stays bounded when
+   * classification falls behind the camera.
+   * 
+   * @param camera Camera that the image came from
+   * @param msg Color Image
+   */
+  void imageCallback( CameraStream & camera, const sensor_msgs::ImageConstPtr & msg)
+  {
+    {
+      std::lock_guard<std::mutex> lock( frame_mutex_ );
+      
+      if( camera.pending_frame_ )
+	{
+	  ++camera.dropped_frames_;
+	  ROS_DEBUG( "Classifier is behind. Dropped frame [ %u ] [ %s ].", camera.pending_frame_->header.seq, camera.name_.c_str() );
+	}
+      
+      camera.pending_frame_ = msg;
+    }
+    frame_cv_.notify_one();
+  }
+
+  /// Classify the latest frame of each camera whenever there is one, taking turns between cameras
+  void processingThread()
+  {
+    while( true )
+      {
+	sensor_msgs::ImageConstPtr msg;
+	CameraStream * camera = NULL;
+	std_msgs::UInt64 dropped_frames;
+	
+	{
+	  std::unique_lock<std::mutex> lock( frame_mutex_ );
+	  frame_cv_.wait( lock, [&]
+			  {
+			    if( !running_ )
+			      return true;
+			    
+			    for(unsigned int offset = 0; offset < cameras_.size(); ++offset )
+			      {
+				CameraStream & candidate = *cameras_[ ( next_camera_ + offset ) % cameras_.size() ];
+				if( candidate.pending_frame_ )
+				  {
+				    next_camera_ = ( next_camera_ + offset + 1 ) % cameras_.size();
+				    camera = &candidate;
+				    return true;
+				  }
+			      }
+			    return false;
+			  } );
+	  
+	  if( !running_ )
+	    return;
+	  
+	  msg = camera->pending_frame_;
+	  camera->pending_frame_.reset();
+	  dropped_frames.data = camera->dropped_frames_;
+	}
+	
+	classifyFrame( *camera, msg );
+	camera->dropped_frames_pub_.publish( dropped_frames );
+      }
+  }
+
+  /** 
+   * For each color, classify the image and publish the results
    * 
+   * @param camera Camera that the image came from. Its buffers are reused.
    * @param msg Color Image
    */
-  void imageCallback(const sensor_msgs::ImageConstPtr & msg)
+  void classifyFrame( CameraStream & camera, const sensor_msgs::ImageConstPtr & msg)
   {
-    cv_bridge::CvImagePtr cv_ptr;
-    uscauv::ColorEncoder encoder;
+    cv_bridge::CvImageConstPtr cv_ptr;
+    cv::Mat input;
+    color_features::PixelFormat format = color_features::PixelFormat::BGR;
 
-    try
+    /// Packed YUV422 is wrapped without a copy and converted tile by tile, so (U,V) features never go through BGR at all
+    if( !color_features::parsePackedEncoding( msg->encoding, format ) )
       {
-	cv_ptr = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
+	if( msg->step < msg->width * 2 || msg->data.size() < msg->step * msg->height )
+	  {
+	    ROS_ERROR( "Malformed [ %s ] image.", msg->encoding.c_str() );
+	    return;
+	  }
+	/// msg outlives input, so the data pointer stays valid
+	input = cv::Mat( msg->height, msg->width, CV_8UC2, const_cast<unsigned char *>( &msg->data[0] ), msg->step );
       }
-    catch (cv_bridge::Exception& e)
+    else
       {
-	ROS_ERROR("cv_bridge exception: %s", e.what());
-	return;
+	/// Only copies if the incoming image isn't already BGR8. We never write to it.
+	try
+	  {
+	    cv_ptr = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::BGR8);
+	  }
+	catch (cv_bridge::Exception& e)
+	  {
+	    ROS_ERROR("cv_bridge exception: %s", e.what());
+	    return;
+	  }
+	input = cv_ptr->image;
       }
 
     /* tic; */
+
+    /// Each tile converts its rows into the shared feature plane once and then classifies every color in them
+    camera.features_.create( input.size(), CV_8UC2 );
+    camera.encoded_.create( input.size(), uscauv::getColorCodecCvType( color_names_.size() ) );
+
+    /// The decision is published with the encoded image, so that the shape matcher searches the same regions
+    bool const regions_only = camera.region_scheduler_.getRegions( input.size(), 0, camera.tracker_regions_ );
+    if( regions_only )
+      {
+	/// Packed YUV422 has to be converted in whole pixel pairs
+	if( format != color_features::PixelFormat::BGR )
+	  {
+	    for( cv::Rect & region : camera.tracker_regions_ )
+	      {
+		int const x1 = std::min( input.cols, region.x + region.width + 1 ) & ~1;
+		region.x &= ~1;
+		region.width = x1 - region.x;
+	      }
+	    uscauv::RegionScheduler::mergeOverlapping( camera.tracker_regions_ );
+	  }
+	
+	camera.encoded_.setTo( 0 );
+	classifyRegions( camera, input, format, camera.tracker_regions_ );
+      }
+    else if( coarse_factor_ > 1 )
+      classifyCoarseToFine( camera, input, format );
+    else
+      worker_pool_->parallelFor( 0, input.rows, [&]( int row_begin, int row_end )
+				 {
+				   classifyRows( input, format, camera.features_, camera.encoded_, row_begin, row_end );
+				 });
+
+    /* toc_info_stream( std::chrono::milliseconds, "Classify all"); */
+
+    publishClassified( camera, camera.encoded_, msg->header, regions_only );
+    return;
+  }
+
+  /** 
+   * Classify a horizontal band of the image. Called concurrently from the worker pool for disjoint row ranges.
+   * 
+   * @param input BGR8 color image, or CV_8UC2 packed YUV422 image
+   * @param format Pixel layout of input
+   * @param feature_plane CV_8UC2 feature plane that this function fills in for its rows
+   * @param encoded Color codec image with one bit per color
+   */
+  void classifyRows( cv::Mat const & input, color_features::PixelFormat const & format, 
+		     cv::Mat & feature_plane, cv::Mat & encoded, int const & row_begin, int const & row_end )
+  {
+    cv::Mat features = feature_plane.rowRange( row_begin, row_end );
+    cv::Mat output = encoded.rowRange( row_begin, row_end );
+    
+    color_features::extractFeatures( input.rowRange( row_begin, row_end ), format, feature_space_, features );
+
+    classifyFeatures( features, output );
+  }
+
+  void classifyFeatures( cv::Mat const & features, cv::Mat & encoded )
+  {
+    if( use_lookup_table_ )
+      lookup_table_.classify( features, encoded );
+    else
+      classifySVM( features, encoded );
+  }
+
+  /** 
+   * Classify a grid of sampled pixels, then classify at full resolution only the coarse_factor_ sized blocks
+   * around grid pixels that hit any color. Everything else in the camera's encoded image is zero.
+   * 
+   * @param input BGR8 color image, or CV_8UC2 packed YUV422 image
+   * @param format Pixel layout of input
+   */
+  void classifyCoarseToFine( CameraStream & camera, cv::Mat const & input, color_features::PixelFormat const & format )
+  {
+    int const factor = coarse_factor_;
+    cv::Size const coarse_size( ( input.cols + factor - 1 ) / factor, ( input.rows + factor - 1 ) / factor );
+
+    camera.coarse_features_.create( coarse_size, CV_8UC2 );
+    camera.coarse_encoded_.create( coarse_size, camera.encoded_.type() );
+
+    /// Sample the center of each block. Only the sampled rows of the input are converted.
+    worker_pool_->parallelFor( 0, coarse_size.height, [&]( int row_begin, int row_end )
+			       {
+				 cv::Mat row_features;
+				 for(int coarse_y = row_begin; coarse_y < row_end; ++coarse_y )
+				   {
+				     int const y = std::min( coarse_y * factor + factor / 2, input.rows - 1 );
+				     color_features::extractFeatures( input.row( y ), format, feature_space_, row_features );
+
+				     unsigned char const * in = row_features.ptr<unsigned char>( 0 );
+				     unsigned char * out = camera.coarse_features_.ptr<unsigned char>( coarse_y );
+				     for(int coarse_x = 0; coarse_x < coarse_size.width; ++coarse_x )
+				       {
+					 int const x = std::min( coarse_x * factor + factor / 2, input.cols - 1 );
+					 out[ 2 * coarse_x ] = in[ 2 * x ];
+					 out[ 2 * coarse_x + 1 ] = in[ 2 * x + 1 ];
+				       }
+				     
+				     cv::Mat coarse_output = camera.coarse_encoded_.row( coarse_y );
+				     classifyFeatures( camera.coarse_features_.row( coarse_y ), coarse_output );
+				   }
+			       });
+
+    /// Any color at all makes a block a candidate. Grow candidates so that object edges between samples are covered.
+    cv::Mat hits = camera.coarse_encoded_;
+    if( hits.channels() > 1 )
+      {
+	/// 64 color layout keeps its upper colors in the second channel
+	std::vector<cv::Mat> words;
+	cv::split( camera.coarse_encoded_, words );
+	cv::bitwise_or( words[0], words[1], hits );
+      }
+    cv::compare( hits, 0, camera.candidates_, cv::CMP_NE );
     
-    for( _ColorThreadMap::iterator thread_it = thread_storage_.begin(); thread_it != thread_storage_.end(); ++thread_it )
+    if( coarse_dilation_ > 0 )
+      cv::dilate( camera.candidates_, camera.candidates_, cv::getStructuringElement( cv::MORPH_RECT, cv::Size( 2 * coarse_dilation_ + 1, 2 * coarse_dilation_ + 1 ) ) );
+
+    /// Merge horizontal spans of candidate blocks into rectangles
+    camera.candidate_blocks_.clear();
+    cv::Rect const frame( 0, 0, input.cols, input.rows );
+    for(int coarse_y = 0; coarse_y < coarse_size.height; ++coarse_y )
       {
+	unsigned char const * candidate = camera.candidates_.ptr<unsigned char>( coarse_y );
+	for(int coarse_x = 0; coarse_x < coarse_size.width; )
+	  {
+	    if( !candidate[ coarse_x ] )
+	      {
+		++coarse_x;
+		continue;
+	      }
+	    
+	    int const span_begin = coarse_x;
+	    while( coarse_x < coarse_size.width && candidate[ coarse_x ] )
+	      ++coarse_x;
 
-	ClassifyThreadStorage::Ptr storage = thread_it->second;
-	
-	/// Copy image into buffer, signal thread to process
-	{
-	  std::lock_guard<std::mutex> lock( storage->m_ );
-	  cv_ptr->image.copyTo( storage->input_ );
-	  storage->state_ = ClassifyThreadStorage::State::READY;
-	}
-	storage->cv_.notify_one();
+	    camera.candidate_blocks_.push_back( cv::Rect( span_begin * factor, coarse_y * factor, 
+							  ( coarse_x - span_begin ) * factor, factor ) & frame );
+	  }
       }
 
-    /// I wanted to play around with this
-    for( _ColorThreadMap::value_type & thread_it : thread_storage_ )
-      {	
+    camera.encoded_.setTo( 0 );
+    classifyRegions( camera, input, format, camera.candidate_blocks_ );
 
-	ClassifyThreadStorage::Ptr storage = thread_it.second;
+    ROS_DEBUG( "Classified [ %d / %d ] blocks at full resolution.", cv::countNonZero( camera.candidates_ ), int( camera.candidates_.total() ) );
+  }
 
-	cv_bridge::CvImage classified_image( cv_ptr->header,
-    					     sensor_msgs::image_encodings::MONO8 );
+  /** 
+   * Classify only the given regions of the image, on the worker pool. The rest of the camera's encoded image is left alone.
+   * 
+   * @param regions Non-overlapping regions, clipped to the image
+   */
+  void classifyRegions( CameraStream & camera, cv::Mat const & input, color_features::PixelFormat const & format, 
+			std::vector<cv::Rect> const & regions )
+  {
+    worker_pool_->parallelFor( 0, regions.size(), [&]( int region_begin, int region_end )
+			       {
+				 for(int region = region_begin; region < region_end; ++region )
+				   {
+				     cv::Rect const & rect = regions[ region ];
+				     cv::Mat features = camera.features_( rect );
+				     cv::Mat output = camera.encoded_( rect );
+				     
+				     color_features::extractFeatures( input( rect ), format, feature_space_, features );
+				     classifyFeatures( features, output );
+				   }
+			       });
+  }
 
-	/// Wait for thread to finish processing the image
-	{
-	  std::unique_lock<std::mutex> lock( storage->m_ );
-	  storage->cv_.wait( lock, [&]{return storage->state_ == ClassifyThreadStorage::State::PROCESSED;} );
-	  encoder.addImage( storage->output_, thread_it.first );
-	  classified_image.image = storage->output_;
-	}
-	
-	classified_image_pub_[ thread_it.first ].publish ( classified_image.toImageMsg() );
+  /** 
+   * Evaluate every SVM at every pixel. Slow, but doesn't require building the lookup table.
+   * 
+   * @param features CV_8UC2 feature image
+   * @param encoded Color codec image with one bit per color
+   */
+  void classifySVM( cv::Mat const & features, cv::Mat & encoded )
+  {
+    switch( encoded.elemSize() )
+      {
+      case 2: classifySVMImpl<uint16_t>( features, encoded ); break;
+      case 4: classifySVMImpl<uint32_t>( features, encoded ); break;
+      default: classifySVMImpl<uint64_t>( features, encoded ); break;
       }
+  }
 
-    /// TODO: Publish debug images for composite colors
-    for( _CompositeColorMap::value_type const & composite : composite_colors_ )
+  template<class __Word>
+    void classifySVMImpl( cv::Mat const & features, cv::Mat & encoded )
+  {
+    /// cv::SVM only classifies floating point samples
+    cv::Mat sample( 1, 2, CV_32FC1 );
+    float * sample_ptr = sample.ptr<float>(0);
+
+    for(int idy = 0; idy < features.rows; ++idy )
       {
-	cv::Mat composite_image;
-	
-	for( _CompositeColor::value_type const & color : composite.second )
+	unsigned char const * in = features.ptr<unsigned char>( idy );
+	__Word * out = encoded.ptr<__Word>( idy );
+
+	for(int idx = 0; idx < features.cols; ++idx, in += 2 )
 	  {
-	    ClassifyThreadStorage::Ptr storage = thread_storage_[ color ];
+	    sample_ptr[0] = in[0];
+	    sample_ptr[1] = in[1];
 
-	    if( composite_image.empty() )
+	    _EncodedType value = 0;
+	    
+	    for( _ColorStorageMap::value_type const & color : color_storage_ )
 	      {
-		storage->output_.copyTo(composite_image);
+		float const response = color.second->svm_.predict( sample );
+
+		if ( response == 1.0 )
+		  value |= _EncodedType(1) << color.second->bit_;
+		else if ( response != -1.0 )
+		  ROS_WARN_THROTTLE( 1, "SVM has incorrect output format. Valid output: {-1, 1}");
 	      }
-	    else
+
+	    for( _CompositeMaskArray::value_type const & composite : composite_masks_ )
 	      {
-		ROS_ASSERT( storage->output_.type() == composite_image.type() && 
-			    storage->output_.size() == composite_image.size() );
-		
-		cv::bitwise_or( storage->output_, composite_image, composite_image );
+		if( value & composite.first )
+		  value |= composite.second;
 	      }
+	    
+	    out[ idx ] = value;
 	  }
-	encoder.addImage( composite_image, composite.first );
       }
+  }
+
+  /** 
+   * Publish the encoded image, and the per-color debug images that someone is subscribed to
+   * 
+   * @param camera Camera whose topics to publish on
+   * @param encoded Color codec image with one bit per color
+   * @param header Header of the original image
+   * @param regions_only Whether only camera.tracker_regions_ were classified
+   */
+  void publishClassified( CameraStream & camera, cv::Mat const & encoded, std_msgs::Header const & header,
+			  bool const & regions_only )
+  {
+    /// Decoding the per-color debug images costs a full pass each, so only do it for topics that someone is listening to
+    for(unsigned int color_idx = 0; color_idx < color_names_.size(); ++color_idx )
+      {
+	_ColorPublisherMap::iterator pub_it = camera.classified_image_pub_.find( color_names_[ color_idx ] );
+	
+	if( pub_it == camera.classified_image_pub_.end() || !pub_it->second.getNumSubscribers() )
+	  continue;
+
+	cv_bridge::CvImage classified_image( header,
+					     sensor_msgs::image_encodings::MONO8 );
+	uscauv::decodeColorBit( encoded, color_idx, classified_image.image );
+	
+	pub_it->second.publish( classified_image.toImageMsg() );
+      }
+
+    uscauv::ColorEncoder encoder( encoded, color_names_ );
+    if( regions_only )
+      encoder.setRegions( camera.tracker_regions_ );
     
-    /* toc_info_stream( std::chrono::milliseconds, "Classify all"); */
-    
-    encoded_image_pub_.publish( encoder, msg->header );
-    return;
+    camera.encoded_image_pub_.publish( encoder, header );
   }
 
 };
@@ -0,0 +1,203 @@
+/***************************************************************************
+ *  include/color_classification/color_features.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+#ifndef USCAUV_COLORCLASSIFICATION_COLORFEATURES_H
+#define USCAUV_COLORCLASSIFICATION_COLORFEATURES_H
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <string>
+
+/**
+ * Conversion from camera images to the two 8-bit channels that our SVMs classify. Shared by
+ * the classifier and svm_trainer so that models are always trained in the space they are used in.
+ */
+namespace color_features
+{
+  /// Encoding strings for packed 4:2:2 images. ROS calls UYVY "yuv422".
+  static char const * const UYVY_ENCODING = "yuv422";
+  static char const * const YUYV_ENCODING = "yuv422_yuy2";
+
+  enum class FeatureSpace
+  {
+    /// Hue and saturation, from HSV
+    HS,
+    /// Chroma (Cb,Cr) of limited range BT.601 YCbCr, which is what packed 4:2:2 cameras put out, so it can be read straight out of their images.
+    UV
+  };
+
+  enum class PixelFormat
+  {
+    BGR,
+    UYVY,
+    YUYV
+  };
+
+  /// @return 0 on success, -1 if name isn't a known feature space
+  inline int parseFeatureSpace( std::string const & name, FeatureSpace & space )
+  {
+    if( name == "hs" )
+      space = FeatureSpace::HS;
+    else if( name == "uv" )
+      space = FeatureSpace::UV;
+    else
+      return -1;
+
+    return 0;
+  }
+
+  inline std::string getFeatureSpaceName( FeatureSpace const & space )
+  {
+    return ( space == FeatureSpace::UV ) ? "uv" : "hs";
+  }
+
+  /// @return 0 on success, -1 if the encoding isn't packed 4:2:2
+  inline int parsePackedEncoding( std::string const & encoding, PixelFormat & format )
+  {
+    if( encoding == UYVY_ENCODING )
+      format = PixelFormat::UYVY;
+    else if( encoding == YUYV_ENCODING || encoding == "yuyv" )
+      format = PixelFormat::YUYV;
+    else
+      return -1;
+
+    return 0;
+  }
+
+  /** 
+   * Pull (Cb,Cr) out of a packed 4:2:2 image without converting it. Both pixels in a pair share the same chroma.
+   * 
+   * @param input CV_8UC2 packed image
+   * @param format UYVY or YUYV
+   * @param features Output CV_8UC2 image
+   */
+  inline void extractPackedChroma( cv::Mat const & input, PixelFormat const & format, cv::Mat & features )
+  {
+    features.create( input.size(), CV_8UC2 );
+
+    /// Byte offsets of U and V within each 4-byte pixel pair
+    int const u_offset = ( format == PixelFormat::UYVY ) ? 0 : 1;
+    int const v_offset = u_offset + 2;
+    int const pairs = input.cols / 2;
+
+    for(int idy = 0; idy < input.rows; ++idy )
+      {
+	unsigned char const * in = input.ptr<unsigned char>( idy );
+	unsigned char * out = features.ptr<unsigned char>( idy );
+
+	for(int idx = 0; idx < pairs; ++idx, in += 4, out += 4 )
+	  {
+	    out[0] = out[2] = in[ u_offset ];
+	    out[1] = out[3] = in[ v_offset ];
+	  }
+	
+	/// An odd trailing pixel has no partner; give it neutral chroma
+	if( input.cols % 2 )
+	  {
+	    out[0] = in[ u_offset ];
+	    out[1] = 128;
+	  }
+      }
+  }
+
+  /** 
+   * Compute limited range BT.601 (Cb,Cr) from a BGR image, so that BGR images land in the same space as
+   * chroma read out of packed 4:2:2 images. OpenCV's CV_BGR2YUV is analog YUV with different scaling, and
+   * its CV_BGR2YCrCb is full range, so neither matches the camera directly.
+   * 
+   * @param input BGR8 image
+   * @param features Output CV_8UC2 image
+   */
+  inline void extractBGRChroma( cv::Mat const & input, cv::Mat & features )
+  {
+    double const kr = 0.299, kb = 0.114, kg = 1.0 - kr - kb;
+    /// Chroma spans 16-240 in limited range
+    double const scale = 224.0 / 255.0;
+    double const cb_scale = scale / ( 2.0 * ( 1.0 - kb ) );
+    double const cr_scale = scale / ( 2.0 * ( 1.0 - kr ) );
+
+    /// Rows are (Cb, Cr), columns are (B, G, R, offset)
+    cv::Matx<double, 2, 4> const transform
+      ( cb_scale * ( 1.0 - kb ), -cb_scale * kg, -cb_scale * kr, 128.0,
+	-cr_scale * kb, -cr_scale * kg, cr_scale * ( 1.0 - kr ), 128.0 );
+
+    features.create( input.size(), CV_8UC2 );
+    cv::transform( input, features, cv::Mat( transform ) );
+  }
+
+  /** 
+   * Convert an image into the given feature space
+   * 
+   * @param input BGR8 image, or CV_8UC2 packed 4:2:2 image
+   * @param format Pixel layout of input
+   * @param space Feature space to convert to
+   * @param features Output CV_8UC2 image. May be a view into a larger image.
+   */
+  inline void extractFeatures( cv::Mat const & input, PixelFormat const & format, 
+			       FeatureSpace const & space, cv::Mat & features )
+  {
+    if( format != PixelFormat::BGR && space == FeatureSpace::UV )
+      {
+	extractPackedChroma( input, format, features );
+	return;
+      }
+    
+    cv::Mat input_bgr = input;
+    if( format == PixelFormat::UYVY )
+      cv::cvtColor( input, input_bgr, CV_YUV2BGR_UYVY );
+    else if( format == PixelFormat::YUYV )
+      cv::cvtColor( input, input_bgr, CV_YUV2BGR_YUY2 );
+
+    if( space == FeatureSpace::UV )
+      {
+	extractBGRChroma( input_bgr, features );
+	return;
+      }
+
+    cv::Mat converted;
+    cv::cvtColor( input_bgr, converted, CV_BGR2HSV );
+
+    /// Keep (H,S)
+    int const from_to[] = { 0,0, 1,1 };
+    
+    features.create( converted.size(), CV_8UC2 );
+    cv::mixChannels( &converted, 1, &features, 1, from_to, 2 );
+  }
+
+} // color_features
+
+#endif // USCAUV_COLORCLASSIFICATION_COLORFEATURES_H
@@ -0,0 +1,240 @@
+/***************************************************************************
+ *  include/color_classification/color_lookup_table.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+#ifndef USCAUV_COLORCLASSIFICATION_COLORLOOKUPTABLE_H
+#define USCAUV_COLORCLASSIFICATION_COLORLOOKUPTABLE_H
+
+/// ROS
+#include <ros/ros.h>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/ml/ml.hpp>
+
+/// uscauv
+#include <uscauv_common/color_codec.h>
+
+/**
+ * Every SVM that we load classifies pairs of 8-bit features ( (H,S) or (U,V) ), so the entire feature space is only
+ * 256x256 points. Instead of evaluating every SVM at every pixel, we evaluate every SVM once
+ * per point in the feature space and store the results as a bitmask in the same format that
+ * uscauv::ColorEncoder produces. Classifying an image is then a single table lookup per pixel.
+ *
+ * The table's word size follows the color codec layout, so it is 16 bits wide for up to 16 colors, 32 bits for up to 32, and 64 bits for up to 64.
+ */
+class ColorLookupTable
+{
+ public:
+  /// Wide enough for a mask of every color in any layout
+  typedef uint64_t _EncodedType;
+
+  static int const FEATURE_RANGE = 256;
+  static unsigned int const MAX_COLORS = uscauv::COLOR_CODEC_MAX_COLORS;
+
+ private:
+  /// FEATURE_RANGE x FEATURE_RANGE, indexed by (channel 0, channel 1) of the feature image
+  cv::Mat table_;
+
+ public:
+ ColorLookupTable()
+  {
+    reset( 16 );
+  }
+
+  /// Clear the table and size its entries for the given number of colors
+  void reset( unsigned int const & colors )
+  {
+    table_.create( FEATURE_RANGE, FEATURE_RANGE, uscauv::getColorCodecCvType( colors ) );
+    clear();
+  }
+
+  void clear()
+  {
+    table_.setTo(0);
+  }
+
+  /**
+   * Evaluate the SVM at every point in the feature space.
+   *
+   * @param svm Trained SVM with two input features and responses in {-1, 1}
+   * @param decision Output FEATURE_RANGE x FEATURE_RANGE CV_8UC1 image, 1 where the SVM responded positively and 0 elsewhere
+   *
+   * @return 0 on success, -1 if the SVM responded with something other than {-1, 1}
+   */
+  static int evaluateSVM( cv::SVM const & svm, cv::Mat & decision )
+  {
+    /// Build every (h,s) pair as a row of floats so that the SVM can classify them in one call
+    cv::Mat samples( FEATURE_RANGE * FEATURE_RANGE, 2, CV_32FC1 ), responses;
+    for(int idy = 0; idy < FEATURE_RANGE; ++idy )
+      {
+	for(int idx = 0; idx < FEATURE_RANGE; ++idx )
+	  {
+	    float * sample = samples.ptr<float>( idy * FEATURE_RANGE + idx );
+	    sample[0] = idy;
+	    sample[1] = idx;
+	  }
+      }
+
+    svm.predict( samples, responses );
+
+    decision.create( FEATURE_RANGE, FEATURE_RANGE, CV_8UC1 );
+    float const * response = responses.ptr<float>(0);
+    unsigned char * out = decision.ptr<unsigned char>(0);
+
+    for(int idx = 0; idx < FEATURE_RANGE * FEATURE_RANGE; ++idx )
+      {
+	if( response[idx] == 1.0f )
+	  out[idx] = 1;
+	else if( response[idx] == -1.0f )
+	  out[idx] = 0;
+	else
+	  {
+	    ROS_WARN( "SVM has incorrect output format. Valid output: {-1, 1}");
+	    return -1;
+	  }
+      }
+
+    return 0;
+  }
+
+  /**
+   * Set the given bit wherever the decision table is non-zero.
+   *
+   * @param decision FEATURE_RANGE x FEATURE_RANGE CV_8UC1 decision table, as produced by evaluateSVM()
+   * @param bit Index of the bit that will represent this color in the encoded image
+   */
+  void addDecisionTable( cv::Mat const & decision, unsigned int const & bit )
+  {
+    ROS_ASSERT( bit < 8 * table_.elemSize() );
+    ROS_ASSERT( decision.type() == CV_8UC1 && decision.rows == FEATURE_RANGE && 
+		decision.cols == FEATURE_RANGE && decision.isContinuous() );
+
+    switch( table_.elemSize() )
+      {
+      case 2: addDecisionTableImpl<uint16_t>( decision, bit ); break;
+      case 4: addDecisionTableImpl<uint32_t>( decision, bit ); break;
+      default: addDecisionTableImpl<uint64_t>( decision, bit ); break;
+      }
+  }
+
+  /**
+   * Composite colors are the union of their components, so their bit is set wherever any of
+   * the component bits are set.
+   *
+   * @param component_mask Mask with the bits of every color that makes up the composite
+   * @param key Mask with only the bit that will represent the composite color
+   */
+  void addComposite( _EncodedType const & component_mask, _EncodedType const & key )
+  {
+    switch( table_.elemSize() )
+      {
+      case 2: addCompositeImpl<uint16_t>( component_mask, key ); break;
+      case 4: addCompositeImpl<uint32_t>( component_mask, key ); break;
+      default: addCompositeImpl<uint64_t>( component_mask, key ); break;
+      }
+  }
+
+  /**
+   * Classify every color at once.
+   *
+   * @param features CV_8UC2 feature image ( i.e. the H and S channels of an HSV image )
+   * @param encoded Output image with one bit per color, in the layout that the table was reset() for
+   */
+  void classify( cv::Mat const & features, cv::Mat & encoded ) const
+  {
+    ROS_ASSERT( features.type() == CV_8UC2 );
+
+    encoded.create( features.size(), table_.type() );
+
+    switch( table_.elemSize() )
+      {
+      case 2: classifyImpl<uint16_t>( features, encoded ); break;
+      case 4: classifyImpl<uint32_t>( features, encoded ); break;
+      default: classifyImpl<uint64_t>( features, encoded ); break;
+      }
+  }
+
+  cv::Mat const & getTable() const
+  {
+    return table_;
+  }
+
+ private:
+  template<class __Word>
+    void addDecisionTableImpl( cv::Mat const & decision, unsigned int const & bit )
+    {
+      __Word const key = __Word(1) << bit;
+      unsigned char const * in = decision.ptr<unsigned char>(0);
+      __Word * entry = table_.ptr<__Word>(0);
+
+      for(int idx = 0; idx < FEATURE_RANGE * FEATURE_RANGE; ++idx )
+	{
+	  if( in[idx] )
+	    entry[idx] |= key;
+	}
+    }
+
+  template<class __Word>
+    void addCompositeImpl( _EncodedType const & component_mask, _EncodedType const & key )
+    {
+      __Word * entry = table_.ptr<__Word>(0);
+
+      for(int idx = 0; idx < FEATURE_RANGE * FEATURE_RANGE; ++idx )
+	{
+	  if( entry[idx] & component_mask )
+	    entry[idx] |= key;
+	}
+    }
+
+  template<class __Word>
+    void classifyImpl( cv::Mat const & features, cv::Mat & encoded ) const
+    {
+      __Word const * table = table_.ptr<__Word>(0);
+
+      for(int idy = 0; idy < features.rows; ++idy )
+	{
+	  unsigned char const * in = features.ptr<unsigned char>( idy );
+	  __Word * out = encoded.ptr<__Word>( idy );
+
+	  for(int idx = 0; idx < features.cols; ++idx, in += 2 )
+	    {
+	      out[ idx ] = table[ (in[0] << 8) | in[1] ];
+	    }
+	}
+    }
+
+};
+
+#endif // USCAUV_COLORCLASSIFICATION_COLORLOOKUPTABLE_H
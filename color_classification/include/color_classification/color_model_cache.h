@@ -0,0 +1,349 @@
+/***************************************************************************
+ *  include/color_classification/color_model_cache.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+#ifndef USCAUV_COLORCLASSIFICATION_COLORMODELCACHE_H
+#define USCAUV_COLORCLASSIFICATION_COLORMODELCACHE_H
+
+/// ROS
+#include <ros/ros.h>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+
+/// Boost filesystem
+#include <boost/filesystem.hpp>
+
+/// POSIX file I/O
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+
+/// color_classification
+#include <color_classification/color_lookup_table.h>
+
+/**
+ * Compiled, memory-mappable form of one SVM color model.
+ *
+ * Parsing an RBF SVM with thousands of support vectors out of YAML takes seconds, but once it is
+ * loaded all that the lookup table needs from it is its decision over the (H,S) plane. The cache
+ * stores only that decision table, and is keyed by a hash of the source YAML so that retraining a
+ * color invalidates it.
+ *
+ * File layout: ColorModelCacheHeader, then the FEATURE_RANGE x FEATURE_RANGE uint8 decision table.
+ */
+struct ColorModelCacheHeader
+{
+  char magic_[8];
+  uint32_t version_;
+  uint32_t feature_range_;
+  uint64_t source_hash_;
+};
+
+class ColorModelCache
+{
+ public:
+  typedef std::shared_ptr<ColorModelCache> Ptr;
+
+  static uint32_t const VERSION = 2;
+
+ private:
+  void * data_;
+  size_t size_;
+
+ public:
+ ColorModelCache(): data_( NULL ), size_( 0 ) {}
+
+  ~ColorModelCache()
+  {
+    close();
+  }
+
+  ColorModelCache( ColorModelCache const & ) = delete;
+  ColorModelCache & operator=( ColorModelCache const & ) = delete;
+
+  /** 
+   * 64-bit FNV-1a hash of a file's contents
+   * 
+   * @return 0 on success, -1 if the file could not be read
+   */
+  static int hashFile( std::string const & path, uint64_t & hash )
+  {
+    std::ifstream file( path.c_str(), std::ios::in | std::ios::binary );
+    if( !file )
+      return -1;
+
+    hash = 14695981039346656037ULL;
+
+    char buffer[ 4096 ];
+    while( file.read( buffer, sizeof( buffer ) ) || file.gcount() )
+      {
+	std::streamsize const count = file.gcount();
+	for(std::streamsize idx = 0; idx < count; ++idx )
+	  {
+	    hash ^= static_cast<unsigned char>( buffer[ idx ] );
+	    hash *= 1099511628211ULL;
+	  }
+      }
+
+    return 0;
+  }
+
+  /** 
+   * Cache file for a color model. The name carries the source hash, so that two models that share a
+   * color name (e.g. different model sets, or several classifiers sharing one cache directory) never
+   * overwrite each other's cache.
+   * 
+   * @param dir Cache directory
+   * @param color_name Name of the color
+   * @param source_hash Hash of the YAML file that the model is loaded from
+   */
+  static std::string getCachePath( std::string const & dir, std::string const & color_name, uint64_t const & source_hash )
+  {
+    char hash_str[ 17 ];
+    std::snprintf( hash_str, sizeof( hash_str ), "%016llx", static_cast<unsigned long long>( source_hash ) );
+    return dir + "/" + color_name + "-" + hash_str + ".cmc";
+  }
+
+  /** 
+   * Map a cache file into memory. Fails if the file is missing, malformed, or was built from a different source.
+   * 
+   * @param path Cache file
+   * @param source_hash Hash of the YAML file that the cache must have been built from
+   * 
+   * @return 0 on success, -1 on failure
+   */
+  int open( std::string const & path, uint64_t const & source_hash )
+  {
+    close();
+
+    int const fd = ::open( path.c_str(), O_RDONLY );
+    if( fd < 0 )
+      return -1;
+
+    struct stat file_stat;
+    if( fstat( fd, &file_stat ) || size_t( file_stat.st_size ) < sizeof( ColorModelCacheHeader ) )
+      {
+	::close( fd );
+	return -1;
+      }
+
+    size_ = file_stat.st_size;
+    data_ = mmap( NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+    /// The mapping stays valid after the descriptor is closed
+    ::close( fd );
+
+    if( data_ == MAP_FAILED )
+      {
+	data_ = NULL;
+	size_ = 0;
+	return -1;
+      }
+
+    ColorModelCacheHeader const & header = getHeader();
+
+    if( std::memcmp( header.magic_, getMagic(), sizeof( header.magic_ ) ) ||
+	header.version_ != VERSION ||
+	header.feature_range_ != ColorLookupTable::FEATURE_RANGE ||
+	header.source_hash_ != source_hash ||
+	size_ != getFileSize() )
+      {
+	close();
+	return -1;
+      }
+    
+    return 0;
+  }
+
+  void close()
+  {
+    if( data_ )
+      munmap( data_, size_ );
+
+    data_ = NULL;
+    size_ = 0;
+  }
+
+  bool isOpen() const
+  {
+    return data_ != NULL;
+  }
+
+  /// FEATURE_RANGE x FEATURE_RANGE CV_8UC1 table that points directly into the mapped file. Valid until close().
+  cv::Mat getDecisionTable() const
+  {
+    ROS_ASSERT( isOpen() );
+    return cv::Mat( ColorLookupTable::FEATURE_RANGE, ColorLookupTable::FEATURE_RANGE, CV_8UC1,
+		    static_cast<unsigned char *>( data_ ) + sizeof( ColorModelCacheHeader ) );
+  }
+
+  /** 
+   * Write a compiled SVM to getCachePath( dir, color_name, source_hash ). The file is written under a temporary
+   * name and then renamed so that other processes never map a partially written cache. Caches of the same color
+   * built from other sources are removed, so that retraining doesn't leave old files behind.
+   * 
+   * @param dir Cache directory
+   * @param color_name Name of the color
+   * @param source_hash Hash of the YAML file that the SVM was loaded from
+   * @param decision Decision table for the SVM, as produced by ColorLookupTable::evaluateSVM()
+   * 
+   * @return 0 on success, -1 on failure
+   */
+  static int write( std::string const & dir, std::string const & color_name, uint64_t const & source_hash, 
+		    cv::Mat const & decision )
+  {
+    std::string const path = getCachePath( dir, color_name, source_hash );
+
+    ROS_ASSERT( decision.type() == CV_8UC1 && decision.isContinuous() &&
+		decision.total() == getTableSize() );
+
+    ColorModelCacheHeader header;
+    std::memset( &header, 0, sizeof( header ) );
+    std::memcpy( header.magic_, getMagic(), sizeof( header.magic_ ) );
+    header.version_ = VERSION;
+    header.feature_range_ = ColorLookupTable::FEATURE_RANGE;
+    header.source_hash_ = source_hash;
+
+    try
+      {
+	boost::filesystem::path const cache_path( path );
+	if( cache_path.has_parent_path() )
+	  boost::filesystem::create_directories( cache_path.parent_path() );
+      }
+    catch( boost::filesystem::filesystem_error const & ex )
+      {
+	ROS_WARN( "Failed to create model cache directory [ %s ].", ex.what() );
+	return -1;
+      }
+
+    std::stringstream temp_path;
+    temp_path << path << ".tmp" << getpid();
+
+    {
+      std::ofstream file( temp_path.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+      if( !file )
+	return -1;
+      
+      file.write( reinterpret_cast<char const *>( &header ), sizeof( header ) );
+      file.write( reinterpret_cast<char const *>( decision.ptr<unsigned char>(0) ), getTableSize() );
+
+      if( !file )
+	{
+	  std::remove( temp_path.str().c_str() );
+	  return -1;
+	}
+    }
+
+    if( std::rename( temp_path.str().c_str(), path.c_str() ) )
+      {
+	std::remove( temp_path.str().c_str() );
+	return -1;
+      }
+
+    removeStale( dir, color_name, path );
+    return 0;
+  }
+
+ private:
+  static char const * getMagic()
+  {
+    return "USCCMC\0";
+  }
+
+  static size_t getTableSize()
+  {
+    return ColorLookupTable::FEATURE_RANGE * ColorLookupTable::FEATURE_RANGE;
+  }
+
+  static size_t getFileSize()
+  {
+    return sizeof( ColorModelCacheHeader ) + getTableSize();
+  }
+
+  /// @return true if file_name is getCachePath()'s file name for color_name and any source hash
+  static bool isCacheFileName( std::string const & file_name, std::string const & color_name )
+  {
+    std::string const prefix = color_name + "-", suffix = ".cmc";
+    size_t const hash_length = 16;
+    
+    if( file_name.size() != prefix.size() + hash_length + suffix.size() ||
+	file_name.compare( 0, prefix.size(), prefix ) ||
+	file_name.compare( prefix.size() + hash_length, suffix.size(), suffix ) )
+      return false;
+
+    for(size_t idx = prefix.size(); idx < prefix.size() + hash_length; ++idx )
+      if( !std::isxdigit( static_cast<unsigned char>( file_name[ idx ] ) ) )
+	return false;
+    
+    return true;
+  }
+
+  /// Remove every cache file of color_name in dir except keep_path
+  static void removeStale( std::string const & dir, std::string const & color_name, std::string const & keep_path )
+  {
+    try
+      {
+	boost::filesystem::path const keep( keep_path );
+	for( boost::filesystem::directory_iterator path_it( dir ); path_it != boost::filesystem::directory_iterator(); ++path_it )
+	  {
+	    boost::filesystem::path const & cache_path = path_it->path();
+	    if( cache_path.filename() == keep.filename() || !isCacheFileName( cache_path.filename().string(), color_name ) )
+	      continue;
+	    
+	    boost::filesystem::remove( cache_path );
+	    ROS_INFO( "Removed stale model cache. [ %s ]", cache_path.string().c_str() );
+	  }
+      }
+    catch( boost::filesystem::filesystem_error const & ex )
+      {
+	ROS_WARN( "Failed to remove stale model caches [ %s ].", ex.what() );
+      }
+  }
+
+  ColorModelCacheHeader const & getHeader() const
+  {
+    return *static_cast<ColorModelCacheHeader const *>( data_ );
+  }
+  
+};
+
+#endif // USCAUV_COLORCLASSIFICATION_COLORMODELCACHE_H
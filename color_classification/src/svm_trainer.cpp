@@ -43,6 +43,9 @@
 #include <opencv/cxcore.h>
 
 #include <uscauv_common/macros.h>
+#include <uscauv_common/worker_pool.h>
+
+#include <color_classification/color_features.h>
 
 /// Boost filesystem
 #include <boost/filesystem.hpp>
@@ -50,6 +53,13 @@
 /// C++11 Threading
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+/// getrusage
+#include <sys/resource.h>
 
 namespace _FileSys = boost::filesystem3;
 
@@ -74,9 +84,357 @@ const std::string keys =
   "{    s| scale         |.125  | Factor by which input images will be downsampled          }"
   "{    k| kernel        |rbf   | Kernel type (rbf, linear, poly, sigmoid)                  }"
   "{    a| auto          |false | Automatically search for optimal SVM training parameters. }"
+  "{    K| grid-kernels  |rbf   | Comma separated kernels to search with --auto             }"
+  "{    G| grid-c        |0.01,0.1,1,10,100 | Comma separated error penalties to search with --auto }"
+  "{    g| grid-gamma    |1e-4,1e-3,1e-2,0.1,1 | Comma separated kernel gammas to search with --auto }"
+  "{    F| folds         |5     | Cross-validation folds for --auto                         }"
+  "{    t| threads       |0     | Worker threads for loading and --auto. 0 uses every core. }"
   "{    C| comment       |false | Optional comment to be inserted into output YAML file     }"
+  "{    f| features      |hs    | Feature space (hs, uv). Must match the classifier's.      }"
+  "{    m| compact       |false | Train on unique feature values instead of every pixel     }"
+  "{    r| conflict      |majority | How --compact labels mixed bins (majority, probability) }"
+  "{    p| probability   |0.5   | Positive fraction at which --conflict=probability labels a bin positive }"
   ;
 
+/// One point in the hyperparameter grid, along with how it did on each fold
+struct GridCandidate
+{
+  cv::SVMParams params_;
+  std::string kernel_name_;
+  std::vector<double> fold_accuracy_;
+  std::vector<double> fold_seconds_;
+
+  double getMeanAccuracy() const
+  {
+    return std::accumulate( fold_accuracy_.begin(), fold_accuracy_.end(), 0.0 ) / fold_accuracy_.size();
+  }
+
+  double getTotalSeconds() const
+  {
+    return std::accumulate( fold_seconds_.begin(), fold_seconds_.end(), 0.0 );
+  }
+};
+
+/// Train and validation halves of one cross-validation split
+struct Fold
+{
+  cv::Mat train_data_, train_labels_, test_data_, test_labels_;
+};
+
+/// One image/mask pair, decoded and preprocessed by a loader task
+struct LoadedImagePair
+{
+  std::string input_path_, mask_path_;
+  /// Full resolution images, kept for the sanity check
+  cv::Mat input_, mask_;
+  /// Downsampled CV_8UC2 features and CV_8UC1 mask that is non-zero on positive pixels
+  cv::Mat features_, positive_;
+  /// Empty if loading succeeded
+  std::string error_;
+};
+
+/** 
+ * Decode, downsample and convert one image/mask pair. Safe to call concurrently on different pairs.
+ * 
+ * @param pair Pair with its paths filled in
+ * @param scale Downsampling factor
+ * @param feature_space Feature space to convert to
+ */
+void loadImagePair( LoadedImagePair & pair, double const & scale, color_features::FeatureSpace const & feature_space )
+{
+  pair.input_ = cv::imread( pair.input_path_, CV_LOAD_IMAGE_COLOR );
+  if( pair.input_.data == NULL )
+    {
+      pair.error_ = "Failed to load image [ " + pair.input_path_ + " ].";
+      return;
+    }
+  
+  pair.mask_ = cv::imread( pair.mask_path_, CV_LOAD_IMAGE_GRAYSCALE );
+  if( pair.mask_.data == NULL )
+    {
+      pair.error_ = "Failed to load mask [ " + pair.mask_path_ + " ].";
+      return;
+    }
+
+  cv::Mat input_ds, mask_ds;
+  cv::resize( pair.input_, input_ds, cv::Size(0.0,0.0), scale, scale, cv::INTER_LINEAR);
+  cv::resize( pair.mask_, mask_ds, cv::Size(0.0,0.0), scale, scale, cv::INTER_LINEAR);
+
+  if( input_ds.size() != mask_ds.size() )
+    {
+      pair.error_ = "Image and mask sizes differ [ " + pair.input_path_ + " ].";
+      return;
+    }
+  
+  /// Same conversion as the classifier
+  color_features::extractFeatures( input_ds, color_features::PixelFormat::BGR, feature_space, pair.features_ );
+
+  /// Only fully masked pixels are positive
+  pair.positive_ = ( mask_ds == 255 );
+}
+
+/// @return Peak resident set size of this process, in megabytes
+double getPeakRSSMB()
+{
+  struct rusage usage;
+  if( getrusage( RUSAGE_SELF, &usage ) )
+    return 0.0;
+  
+  /// Linux reports kilobytes
+  return usage.ru_maxrss / 1024.0;
+}
+
+/// Number of distinct values of one 8-bit feature pair
+int const FEATURE_BINS = 256 * 256;
+
+/// How many positive and negative pixels fell on each feature value
+struct FeatureHistogram
+{
+  std::vector<unsigned int> positive_;
+  std::vector<unsigned int> negative_;
+  
+FeatureHistogram(): positive_( FEATURE_BINS, 0 ), negative_( FEATURE_BINS, 0 ) {}
+
+  /** 
+   * @param features CV_8UC2 feature image
+   * @param positive CV_8UC1, non-zero where the pixel belongs to the color
+   */
+  void add( cv::Mat const & features, cv::Mat const & positive )
+  {
+    for(int idy = 0; idy < features.rows; ++idy )
+      {
+	unsigned char const * in = features.ptr<unsigned char>( idy );
+	unsigned char const * label = positive.ptr<unsigned char>( idy );
+	
+	for(int idx = 0; idx < features.cols; ++idx, in += 2 )
+	  {
+	    int const bin = ( in[0] << 8 ) | in[1];
+	    if( label[idx] )
+	      ++positive_[ bin ];
+	    else
+	      ++negative_[ bin ];
+	  }
+      }
+  }
+};
+
+/** 
+ * Turn a histogram into one training sample per occupied feature value.
+ * 
+ * cv::SVM has no per-sample weights, so each class is weighted by the average number of pixels that its
+ * samples stand for. That keeps the relative mass of the two classes the same as in the uncompacted data.
+ * 
+ * @param histogram Pixel counts
+ * @param probability If negative, bins take the majority label. Otherwise bins are positive when at least this fraction of their pixels is.
+ * @param data Output CV_32FC1 samples, one per row
+ * @param labels Output CV_32FC1 labels in {-1, 1}
+ * @param class_weights Output 1x2 CV_64FC1 weights for labels { -1, 1 }, in the form that cv::SVMParams expects
+ */
+void compactSamples( FeatureHistogram const & histogram, double const & probability, 
+		     cv::Mat & data, cv::Mat & labels, cv::Mat & class_weights )
+{
+  int occupied = 0;
+  for(int bin = 0; bin < FEATURE_BINS; ++bin )
+    if( histogram.positive_[bin] || histogram.negative_[bin] )
+      ++occupied;
+
+  data.create( occupied, 2, CV_32FC1 );
+  labels.create( occupied, 1, CV_32FC1 );
+
+  double mass[2] = { 0.0, 0.0 };
+  int samples[2] = { 0, 0 };
+  
+  int row = 0;
+  for(int bin = 0; bin < FEATURE_BINS; ++bin )
+    {
+      unsigned int const positive = histogram.positive_[bin], negative = histogram.negative_[bin];
+      if( !positive && !negative )
+	continue;
+
+      bool is_positive;
+      if( probability < 0 )
+	is_positive = positive > negative;
+      else
+	is_positive = double( positive ) / ( positive + negative ) >= probability;
+
+      float * sample = data.ptr<float>( row );
+      sample[0] = bin >> 8;
+      sample[1] = bin & 0xff;
+      labels.at<float>( row ) = is_positive ? 1.0f : -1.0f;
+      
+      mass[ is_positive ] += positive + negative;
+      ++samples[ is_positive ];
+      ++row;
+    }
+
+  /// Normalized so that the average weight is 1 and --error-penalty keeps its usual scale
+  class_weights.create( 1, 2, CV_64FC1 );
+  double weight[2];
+  for(int label = 0; label < 2; ++label )
+    weight[label] = samples[label] ? mass[label] / samples[label] : 1.0;
+  double const mean_weight = ( weight[0] + weight[1] ) / 2.0;
+  class_weights.at<double>( 0 ) = weight[0] / mean_weight;
+  class_weights.at<double>( 1 ) = weight[1] / mean_weight;
+}
+
+/** 
+ * Parse a comma separated list of numbers
+ * 
+ * @return 0 on success, -1 if any element isn't a number
+ */
+int parseList( std::string const & list, std::vector<double> & values )
+{
+  std::stringstream list_stream( list );
+  std::string element;
+  
+  while( std::getline( list_stream, element, ',' ) )
+    {
+      char * end;
+      double const value = strtod( element.c_str(), &end );
+      if( end == element.c_str() || *end != '\0' )
+	return -1;
+      values.push_back( value );
+    }
+  return values.empty() ? -1 : 0;
+}
+
+/** 
+ * Shuffle the samples and split them into k train/test folds. Every sample lands in exactly one test set.
+ * 
+ * @param data CV_32FC1 samples, one per row
+ * @param labels CV_32FC1 labels, one per row
+ * @param k Number of folds
+ * @param folds Output folds
+ */
+void makeFolds( cv::Mat const & data, cv::Mat const & labels, unsigned int const & k, std::vector<Fold> & folds )
+{
+  int const rows = data.rows;
+  
+  /// Fixed seed so that repeated runs report comparable numbers
+  std::vector<int> order( rows );
+  for(int idx = 0; idx < rows; ++idx )
+    order[idx] = idx;
+  cv::RNG rng( 0x5eed );
+  for(int idx = rows - 1; idx > 0; --idx )
+    std::swap( order[idx], order[ rng.uniform( 0, idx + 1 ) ] );
+
+  folds.resize( k );
+  for(unsigned int fold = 0; fold < k; ++fold )
+    {
+      Fold & out = folds[fold];
+
+      /// Test rows are order[ fold ], order[ fold + k ], ...
+      int const test_rows = rows / k + ( int( fold ) < rows % int( k ) ? 1 : 0 );
+      out.test_data_.create( test_rows, data.cols, CV_32FC1 );
+      out.test_labels_.create( test_rows, 1, CV_32FC1 );
+      out.train_data_.create( rows - test_rows, data.cols, CV_32FC1 );
+      out.train_labels_.create( rows - test_rows, 1, CV_32FC1 );
+
+      int test_idx = 0, train_idx = 0;
+      for(int idx = 0; idx < rows; ++idx )
+	{
+	  bool const is_test = ( idx % k ) == fold;
+	  cv::Mat & out_data = is_test ? out.test_data_ : out.train_data_;
+	  cv::Mat & out_labels = is_test ? out.test_labels_ : out.train_labels_;
+	  int & out_idx = is_test ? test_idx : train_idx;
+	  
+	  data.row( order[idx] ).copyTo( out_data.row( out_idx ) );
+	  out_labels.at<float>( out_idx ) = labels.at<float>( order[idx] );
+	  ++out_idx;
+	}
+    }
+}
+
+/** 
+ * Cross-validate every candidate on every fold. Each ( candidate, fold ) pair is trained as its own task,
+ * so wall-clock time scales with the number of threads in the pool.
+ * 
+ * @param pool Pool to train on
+ * @param folds Splits from makeFolds()
+ * @param candidates Grid to search. Accuracy and timing are filled in.
+ */
+void crossValidate( uscauv::WorkerPool & pool, std::vector<Fold> const & folds, std::vector<GridCandidate> & candidates )
+{
+  std::vector<uscauv::WorkerPool::TaskType> tasks;
+  std::mutex print_mutex;
+  unsigned int finished = 0;
+  unsigned int const total = candidates.size() * folds.size();
+
+  for( GridCandidate & candidate : candidates )
+    {
+      candidate.fold_accuracy_.assign( folds.size(), 0.0 );
+      candidate.fold_seconds_.assign( folds.size(), 0.0 );
+
+      for(unsigned int fold_idx = 0; fold_idx < folds.size(); ++fold_idx )
+	{
+	  /// Every task writes to its own slot, so results need no locking
+	  tasks.push_back( [&, fold_idx]()
+			   {
+			     Fold const & fold = folds[ fold_idx ];
+			     std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+
+			     cv::SVM svm;
+			     svm.train( fold.train_data_, fold.train_labels_, cv::Mat(), cv::Mat(), candidate.params_ );
+			     
+			     cv::Mat prediction;
+			     svm.predict( fold.test_data_, prediction );
+			     
+			     int const correct = cv::countNonZero( prediction == fold.test_labels_ );
+			     candidate.fold_accuracy_[ fold_idx ] = fold.test_data_.rows ? double( correct ) / fold.test_data_.rows : 0.0;
+			     candidate.fold_seconds_[ fold_idx ] = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+			     std::lock_guard<std::mutex> lock( print_mutex );
+			     std::cout << "Finished [ " << ++finished << " / " << total << " ] " << candidate.kernel_name_
+				       << " C=" << candidate.params_.C << " gamma=" << candidate.params_.gamma
+				       << " fold " << fold_idx << std::endl;
+			   });
+	}
+    }
+  
+  pool.run( tasks );
+}
+
+/// Print one row per candidate, with its accuracy and training time on every fold
+void printGridTable( std::vector<GridCandidate> const & candidates )
+{
+  if( candidates.empty() )
+    return;
+
+  /// Rows are formatted in their own streams so that the widths and precisions don't stick to std::cout
+  std::stringstream header;
+  header << std::left << std::setw(10) << "kernel" << std::setw(10) << "C" << std::setw(10) << "gamma";
+  for(unsigned int fold = 0; fold < candidates.front().fold_accuracy_.size(); ++fold )
+    {
+      std::stringstream fold_header;
+      fold_header << "fold" << fold << " acc/s";
+      header << std::setw(18) << fold_header.str();
+    }
+  header << std::setw(10) << "mean acc" << std::setw(10) << "total s";
+  std::cout << header.str() << std::endl;
+  
+  for( GridCandidate const & candidate : candidates )
+    {
+      std::stringstream row;
+      row << std::left << std::setw(10) << candidate.kernel_name_ << std::setw(10) << candidate.params_.C;
+      if( candidate.params_.kernel_type == cv::SVM::LINEAR )
+	row << std::setw(10) << "-";
+      else
+	row << std::setw(10) << candidate.params_.gamma;
+      
+      for(unsigned int fold = 0; fold < candidate.fold_accuracy_.size(); ++fold )
+	{
+	  std::stringstream fold_cell;
+	  fold_cell << std::fixed << std::setprecision(4) << candidate.fold_accuracy_[fold] << "/" 
+		    << std::setprecision(1) << candidate.fold_seconds_[fold];
+	  row << std::setw(18) << fold_cell.str();
+	}
+      
+      row << std::fixed << std::setprecision(4) << std::setw(10) << candidate.getMeanAccuracy() 
+	  << std::setprecision(1) << std::setw(10) << candidate.getTotalSeconds();
+      std::cout << row.str() << std::endl;
+    }
+}
+
 int main(int argc, const char ** argv)
 {
   std::cout << "USC AUV SVM color classifier trainer" << std::endl;
@@ -98,18 +456,49 @@ int main(int argc, const char ** argv)
   const double error_penalty    = parser.get<float>("error-penalty");
   const double scale            = parser.get<float>("scale");
   const bool auto_train         = parser.get<bool>("auto");
+  const int folds               = parser.get<int>("folds");
+  const int threads             = parser.get<int>("threads");
+  const bool compact            = parser.get<bool>("compact");
+  const double probability      = parser.get<float>("probability");
+  const std::string conflict    = parser.get<std::string>("conflict");
+
+  if( conflict != "majority" && conflict != "probability" )
+    {
+      std::cout << "Invalid conflict resolution [ " << conflict << " ]. Valid values: { majority, probability }" << std::endl;
+      return 0;
+    }
   
   std::string kernel_str   = parser.get<std::string>("kernel");
   std::transform(kernel_str.begin(), kernel_str.end(), kernel_str.begin(), ::tolower);
   
   const int kernel_type = basis_map[kernel_str];
 
+  std::string const feature_space_str = parser.get<std::string>("features");
+  color_features::FeatureSpace feature_space;
+  if( color_features::parseFeatureSpace( feature_space_str, feature_space ) )
+    {
+      std::cout << "Invalid feature space [ " << feature_space_str << " ]. Valid feature spaces: { hs, uv }" << std::endl;
+      return 0;
+    }
+
+  /// WorkerPool takes an unsigned count, so a negative one would wrap
+  if( threads < 0 )
+    {
+      std::cout << "Invalid thread count [ " << threads << " ]. Must be non-negative." << std::endl;
+      return 0;
+    }
+
   _ImagePairArray input_images;
 
   /// Used later on when we write the names of all of the images we used to file
   std::vector<std::pair<std::string, std::string> > path_str;
 
-  /// Traverse image directory and attempt to load images ------------------------------------
+  std::vector<LoadedImagePair> loaded_pairs;
+
+  /// Shared by the loader and the grid search
+  uscauv::WorkerPool pool( threads );
+
+  /// Traverse image directory and find image/mask pairs ------------------------------------
 
   _FileSys::path image_dir( image_path );
 
@@ -159,30 +548,12 @@ int main(int argc, const char ** argv)
 	      continue;
 	    }
 	  
-	  /// Load the image file and mask ------------------------------------
-	  std::string input_str = path_it->normalize().string(),
-	    mask_str = mask_path.normalize().string();
-	  
-	  cv::Mat input, mask;
+	  std::cout << "Found mask." << std::endl;
 	  
-	  input = cv::imread( input_str, CV_LOAD_IMAGE_COLOR );
-	  if( input.data == NULL )
-	    {
-	      std::cout << "Failed to load image [ " << input_str << " ]. " << std::endl;
-	      continue;
-	    }
-	  std::cout << "Training image loaded successfully. ";
-
-	  mask = cv::imread( mask_str, CV_LOAD_IMAGE_GRAYSCALE );
-	  if( mask.data == NULL )
-	    {
-	      std::cout << "Failed to load mask [ " << mask_str << " ]. " << std::endl;
-	      continue;
-	    }
-	  std::cout << "Mask image loaded successfully." << std::endl;
-
-	  input_images.push_back( std::make_pair( input, mask ) );
-	  path_str.push_back ( std::make_pair( input_str, mask_str ) );
+	  LoadedImagePair pair;
+	  pair.input_path_ = path_it->normalize().string();
+	  pair.mask_path_ = mask_path.normalize().string();
+	  loaded_pairs.push_back( pair );
 	}
 
     }
@@ -192,6 +563,33 @@ int main(int argc, const char ** argv)
       return 0;
     }
 
+  /// Decode and preprocess every pair concurrently ------------------------------------
+  
+  std::cout << "Loading [ " << loaded_pairs.size() << " ] image pairs on [ " << pool.size() + 1 << " ] threads..." << std::endl;
+  std::chrono::steady_clock::time_point const load_start = std::chrono::steady_clock::now();
+
+  pool.parallelFor( 0, loaded_pairs.size(), [&]( int begin, int end )
+		    {
+		      for(int idx = begin; idx < end; ++idx )
+			loadImagePair( loaded_pairs[idx], scale, feature_space );
+		    }, loaded_pairs.size() );
+
+  std::vector<LoadedImagePair *> good_pairs;
+  size_t decoded_bytes = 0;
+  for( LoadedImagePair & pair : loaded_pairs )
+    {
+      if( !pair.error_.empty() )
+	{
+	  std::cout << pair.error_ << " Skipping..." << std::endl;
+	  continue;
+	}
+      
+      decoded_bytes += pair.input_.total() * pair.input_.elemSize() + pair.mask_.total() * pair.mask_.elemSize();
+      input_images.push_back( std::make_pair( pair.input_, pair.mask_ ) );
+      path_str.push_back ( std::make_pair( pair.input_path_, pair.mask_path_ ) );
+      good_pairs.push_back( &pair );
+    }
+
   std::cout << "Loaded [ " << input_images.size() << " ] training data sets." << std::endl;
   
   if ( input_images.size() == 0 )
@@ -200,54 +598,68 @@ int main(int argc, const char ** argv)
       return 0;
     }
 
+  cv::Mat all_training, all_mask, class_weights;
 
-  cv::Mat all_training, all_mask;
-
-  unsigned int positive_mask_count = 0;
-  
-  /// Concatenate all of the input images into one giant vector of pixels for training
-  for( _ImagePairArray::iterator input_it = input_images.begin(); input_it != input_images.end(); ++input_it )
+  unsigned int positive_mask_count = 0, pixel_count = 0;
+  FeatureHistogram histogram;
 
+  /// Each image owns a slice of the training set starting at its offset
+  std::vector<int> offsets( good_pairs.size() + 1, 0 );
+  for(unsigned int idx = 0; idx < good_pairs.size(); ++idx )
     {
-      cv::Mat input, input_ds, mask;
-
-      /// OpenCV SVM training requires floating point data
-      
-      cv::resize( input_it->first, input_ds, cv::Size(0.0,0.0), scale, scale, cv::INTER_LINEAR);
-
-      /// convert to hsv color scheme
-      cv::cvtColor(input_ds, input_ds, CV_BGR2HSV);
+      cv::Mat const & positive = good_pairs[idx]->positive_;
+      positive_mask_count += cv::countNonZero( positive );
+      pixel_count += positive.total();
+      offsets[ idx + 1 ] = offsets[ idx ] + positive.total();
 
-      /// Remove value channel
-      cv::Mat input_hs( input_ds.rows, input_ds.cols, CV_8UC2 ), input_v( input_ds.rows, input_ds.cols, CV_8UC1 );
-      cv::Mat mix_out[] { input_hs, input_v };
-      int from_to[] = { 0,0, 1,1, 2,2 };
-      cv::mixChannels( &input_ds, 1, mix_out, 2, from_to, 3);
+      if( compact )
+	histogram.add( good_pairs[idx]->features_, positive );
+    }
+  
+  if( !compact )
+    {
+      /// Allocate once, then fill every image's slice concurrently. OpenCV SVM training requires floating point data.
+      all_training.create( pixel_count, 2, CV_32FC1 );
+      all_mask.create( pixel_count, 1, CV_32FC1 );
+
+      pool.parallelFor( 0, good_pairs.size(), [&]( int begin, int end )
+			{
+			  for(int idx = begin; idx < end; ++idx )
+			    {
+			      cv::Mat const & features = good_pairs[idx]->features_;
+			      cv::Mat const & positive = good_pairs[idx]->positive_;
+			      
+			      cv::Mat training_slice = all_training.rowRange( offsets[idx], offsets[ idx + 1 ] );
+			      cv::Mat mask_slice = all_mask.rowRange( offsets[idx], offsets[ idx + 1 ] );
+			      
+			      /// Slices are continuous, so they can be viewed with the image's shape and written in place
+			      cv::Mat training_view = training_slice.reshape( 2, features.rows );
+			      features.convertTo( training_view, CV_32F );
+			      
+			      /// {0, 255} -> {-1, 1}. SVM only accepts CV_32F labels.
+			      cv::Mat mask_view = mask_slice.reshape( 1, positive.rows );
+			      positive.convertTo( mask_view, CV_32F, 2.0 / 255.0, -1.0 );
+			    }
+			}, good_pairs.size() );
+    }
 
-      
-      input_hs.convertTo( input, CV_32F );
-      input = input.reshape( 1, input.size().height * input.size().width );
-      all_training.push_back( input );
+  /// The downsampled copies aren't needed anymore
+  for( LoadedImagePair * pair : good_pairs )
+    {
+      pair->features_.release();
+      pair->positive_.release();
+    }
 
-      cv::resize( input_it->second, mask, cv::Size(0.0,0.0), scale, scale, cv::INTER_LINEAR);
-      // mask = input_it->second;
-      // input_it->second.convertTo( mask, CV_32FC1 );
-      // mask = mask.reshape( 1, input.size().height * input.size().width );
+  double const load_seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - load_start ).count();
+  std::cout << "Loaded and preprocessed [ " << input_images.size() << " ] pairs in [ " << load_seconds << " ] seconds ( " 
+	    << input_images.size() / load_seconds << " pairs/s, " << decoded_bytes / ( 1024.0 * 1024.0 ) / load_seconds 
+	    << " MB/s decoded ). Peak memory: [ " << getPeakRSSMB() << " ] MB" << std::endl;
 
-      /// TODO: Convert data without explicitly using this for loop
-      for(cv::MatConstIterator_<unsigned char> mask_it = mask.begin<unsigned char>(); mask_it != mask.end<unsigned char>(); ++mask_it)
-	{
-	  if ( *mask_it == 255 )
-	    {
-	      /// SVM only accepts CV_32FS, so we must explicitly add elements as floats using the trailing f.
-	      all_mask.push_back( 1.0f );
-	      ++positive_mask_count;
-	    }
-	  else 
-	    {
-	      all_mask.push_back( -1.0f );
-	    }
-	}
+  if( compact )
+    {
+      compactSamples( histogram, ( conflict == "probability" ) ? probability : -1.0, all_training, all_mask, class_weights );
+      std::cout << "Compacted [ " << pixel_count << " ] pixels into [ " << all_training.rows << " ] unique samples. Class weights: " 
+		<< class_weights << std::endl;
     }
   
   std::cout << "Training data size: " << "( " << all_training.size().height << ", " << all_training.size().width << " ), Depth: "
@@ -259,6 +671,7 @@ int main(int argc, const char ** argv)
 
   std::cout << "Training SVM..." << std::endl;
   std::cout << "Kernel type: [ " << kernel_str << " ]" << std::endl;
+  std::cout << "Feature space: [ " << feature_space_str << " ]" << std::endl;
   std::cout << "Max iterations: " << (int)iterations << ", Error penalty: " << error_penalty << std::endl;
   std::cout << "Grid search: " << brk( std::boolalpha << auto_train ) << std::endl;
   
@@ -272,6 +685,89 @@ int main(int argc, const char ** argv)
   /// TODO: figure out what these parameters are, and what their counterparts in that output yaml correspond to
   svm_params.term_crit = cv::TermCriteria( CV_TERMCRIT_ITER, (int)iterations, 1e-6f );
 
+  /// cv::SVMParams only holds a pointer, so this has to outlive training
+  CvMat class_weights_header;
+  if( !class_weights.empty() )
+    {
+      class_weights_header = class_weights;
+      svm_params.class_weights = &class_weights_header;
+    }
+
+  /// Grid search ------------------------------------
+  if( auto_train )
+    {
+      std::vector<double> grid_c, grid_gamma;
+      if( parseList( parser.get<std::string>("grid-c"), grid_c ) || parseList( parser.get<std::string>("grid-gamma"), grid_gamma ) )
+	{
+	  std::cout << "Error: Invalid grid. Expected comma separated numbers." << std::endl;
+	  return 0;
+	}
+      
+      if( folds < 2 || folds > all_training.rows )
+	{
+	  std::cout << "Error: Invalid fold count [ " << folds << " ]." << std::endl;
+	  return 0;
+	}
+      
+      std::vector<GridCandidate> candidates;
+      std::stringstream kernel_list( parser.get<std::string>("grid-kernels") );
+      std::string grid_kernel;
+      while( std::getline( kernel_list, grid_kernel, ',' ) )
+	{
+	  std::transform(grid_kernel.begin(), grid_kernel.end(), grid_kernel.begin(), ::tolower);
+	  std::map<std::string, int>::const_iterator basis_it = basis_map.find( grid_kernel );
+	  if( basis_it == basis_map.end() )
+	    {
+	      std::cout << "Error: Unknown kernel [ " << grid_kernel << " ]." << std::endl;
+	      return 0;
+	    }
+
+	  for( double const & c : grid_c )
+	    {
+	      for( double const & gamma : grid_gamma )
+		{
+		  GridCandidate candidate;
+		  candidate.kernel_name_ = grid_kernel;
+		  candidate.params_ = svm_params;
+		  candidate.params_.kernel_type = basis_it->second;
+		  candidate.params_.C = c;
+		  candidate.params_.gamma = gamma;
+		  /// OpenCV rejects polynomial kernels of degree 0
+		  candidate.params_.degree = 3;
+		  candidates.push_back( candidate );
+		  
+		  /// Linear kernels don't use gamma
+		  if( basis_it->second == cv::SVM::LINEAR )
+		    break;
+		}
+	    }
+	}
+
+      std::cout << "Splitting training data into [ " << folds << " ] folds..." << std::endl;
+      std::vector<Fold> fold_data;
+      makeFolds( all_training, all_mask, folds, fold_data );
+
+      std::cout << "Cross-validating [ " << candidates.size() << " ] candidates on [ " << pool.size() + 1 << " ] threads..." << std::endl;
+
+      std::chrono::steady_clock::time_point const search_start = std::chrono::steady_clock::now();
+      crossValidate( pool, fold_data, candidates );
+      double const search_seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - search_start ).count();
+      
+      printGridTable( candidates );
+
+      std::vector<GridCandidate>::const_iterator best = std::max_element( candidates.begin(), candidates.end(), 
+									  []( GridCandidate const & a, GridCandidate const & b )
+									  { return a.getMeanAccuracy() < b.getMeanAccuracy(); } );
+      
+      std::cout << "Grid search finished in [ " << search_seconds << " ] seconds. Best: [ " << best->kernel_name_ 
+		<< " C=" << best->params_.C << " gamma=" << best->params_.gamma << " ], mean accuracy [ " 
+		<< best->getMeanAccuracy() << " ]" << std::endl;
+      
+      /// The final model is trained on every fold with the winning parameters
+      svm_params = best->params_;
+      kernel_str = best->kernel_name_;
+    }
+
   time_t before_train, after_train;
   double seconds;
 
@@ -289,14 +785,8 @@ int main(int argc, const char ** argv)
   std::mutex svm_done_mutex;
 
   /// captures local variables by reference
-  std::function<void()> train_f;
-
-  if (auto_train )
-    train_f = [&]() { SVM.train_auto( all_training, all_mask, cv::Mat(), cv::Mat(), svm_params ); 
+  std::function<void()> train_f = [&]() { SVM.train( all_training, all_mask, cv::Mat(), cv::Mat(), svm_params ); 
 					  svm_done_mutex.lock(); svm_done = true; svm_done_mutex.unlock(); };
-  else
-    train_f = [&]() { SVM.train( all_training, all_mask, cv::Mat(), cv::Mat(), svm_params ); 
-		      svm_done_mutex.lock(); svm_done = true; svm_done_mutex.unlock(); };
 
 
   std::function<void()> status_f = [&]() { 
@@ -358,26 +848,19 @@ int main(int argc, const char ** argv)
       std::stringstream image_name;
       image_name << color_name << image_count << ".png";
 
-      cv::Mat & input = input_it->first, input_float, prediction, output;
+      cv::Mat & input = input_it->first, input_features, prediction, output;
 
-      /// convert to hsv color scheme
-      cv::cvtColor(input, input_float, CV_BGR2HSV);
+      color_features::extractFeatures( input, color_features::PixelFormat::BGR, feature_space, input_features );
 
-      /// remove v term
-      cv::Mat input_hs( input_float.rows, input_float.cols, CV_8UC2 ), input_v( input_float.rows, input_float.cols, CV_8UC1 );
-      cv::Mat mix_out[] { input_hs, input_v };
-      int from_to[] = { 0,0, 1,1, 2,2 };
-      cv::mixChannels( &input_float, 1, mix_out, 2, from_to, 3);
-
-      input_hs.convertTo( input_hs, CV_32F );
+      input_features.convertTo( input_features, CV_32F );
 
       /// Classify the image that we used to train
       prediction = cv::Mat( input.size(), CV_8UC3 );
   
       cv::MatIterator_<cv::Vec3b> img_it = prediction.begin<cv::Vec3b>();
-      cv::MatConstIterator_<cv::Vec2f> data_it = input_hs.begin<cv::Vec2f>();
+      cv::MatConstIterator_<cv::Vec2f> data_it = input_features.begin<cv::Vec2f>();
   
-      for(; data_it != input_hs.end<cv::Vec2f>() ; ++data_it, ++img_it )
+      for(; data_it != input_features.end<cv::Vec2f>() ; ++data_it, ++img_it )
 	{
 	  float response = SVM.predict( cv::Mat(*data_it) );
       
@@ -455,6 +938,9 @@ int main(int argc, const char ** argv)
   /// The second SVM.write arg sets the name of the top level node in the yaml file (i.e. green, orange, etc.)
   SVM.write(svm_storage, color_name.c_str() );
 
+  /// The classifier warns if it is configured for a different feature space than this
+  cvWriteString( svm_storage, "feature_space", feature_space_str.c_str() );
+
   
   cvReleaseFileStorage( &svm_storage );
   std::cout << "Write success." << std::endl;
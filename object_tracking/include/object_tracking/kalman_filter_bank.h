@@ -0,0 +1,254 @@
+/***************************************************************************
+ *  include/object_tracking/kalman_filter_bank.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_OBJECTTRACKING_KALMANFILTERBANK
+#define USCAUV_OBJECTTRACKING_KALMANFILTERBANK
+
+/// Eigen
+#include <Eigen/Dense>
+#include <Eigen/Cholesky>
+
+/// cpp11
+#include <vector>
+#include <limits>
+#include <cmath>
+
+namespace uscauv
+{
+
+  /**
+   * A set of LinearKalmanFilters that all share the same dynamics, stored as structure of arrays. States are the
+   * columns of one matrix and covariances are side by side in another, so predict() is two matrix products over every
+   * filter at once instead of one small product per filter. Each filter also carries an integer label (e.g. an interned
+   * color) and the log determinant of its predicted covariance, which predict() refreshes for every filter.
+   *
+   * Removing filters compacts the storage in place. Storage only grows, so a bank that has reached its working size
+   * stops allocating.
+   */
+  template<unsigned int __StateDim, typename __NumericType = double>
+    class LinearKalmanFilterBank
+    {
+    public:
+    typedef Eigen::Matrix<__NumericType, __StateDim, 1>              StateVector;
+    typedef Eigen::Matrix<__NumericType, __StateDim, __StateDim>     StateMatrix;
+    
+    template<unsigned int __UpdateDim>
+    struct Update
+    {
+      typedef Eigen::Matrix<__NumericType, __UpdateDim, 1>           VectorType;
+      typedef Eigen::Matrix<__NumericType, __UpdateDim, __UpdateDim> CovarianceType;
+      typedef Eigen::Matrix<__NumericType, __UpdateDim, __StateDim>  TransitionType;
+      typedef Eigen::Matrix<__NumericType, __StateDim, __UpdateDim>  GainType;
+    };
+
+    private:
+    typedef Eigen::Matrix<__NumericType, __StateDim, Eigen::Dynamic> _BankMatrix;
+    
+    public:
+    typedef typename _BankMatrix::ConstColXpr ConstStateBlock;
+    typedef Eigen::Block<_BankMatrix const, __StateDim, __StateDim> ConstCovarianceBlock;
+
+    private:
+    /// Column i is filter i's state
+    _BankMatrix states_;
+    /// Filter i's covariance is columns [ i * __StateDim, (i + 1) * __StateDim )
+    _BankMatrix covs_;
+    /// Scratch for predict(), the same shape as covs_
+    _BankMatrix product_;
+    std::vector<__NumericType> log_dets_;
+    std::vector<int> labels_;
+    unsigned int size_;
+    unsigned int capacity_;
+
+    public:
+    LinearKalmanFilterBank(): size_( 0 ), capacity_( 0 ) {}
+
+    unsigned int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    unsigned int capacity() const { return capacity_; }
+    
+    void clear()
+    {
+      size_ = 0;
+    }
+
+    /// Make room for capacity filters. Existing filters are kept.
+    void reserve( unsigned int const & capacity )
+    {
+      if( capacity <= capacity_ )
+	return;
+
+      states_.conservativeResize( Eigen::NoChange, capacity );
+      covs_.conservativeResize( Eigen::NoChange, capacity * __StateDim );
+      product_.resize( Eigen::NoChange, capacity * __StateDim );
+      log_dets_.resize( capacity );
+      labels_.resize( capacity );
+      capacity_ = capacity;
+    }
+
+    /// @return Index of the new filter
+    unsigned int add( StateVector const & state, StateMatrix const & cov, int const & label )
+    {
+      if( size_ == capacity_ )
+	reserve( std::max( 4u, 2 * capacity_ ) );
+
+      unsigned int const idx = size_++;
+      states_.col( idx ) = state;
+      covs_.template middleCols<__StateDim>( idx * __StateDim ) = cov;
+      labels_[ idx ] = label;
+      refreshLogDet( idx );
+      
+      return idx;
+    }
+
+    ConstStateBlock state( unsigned int const & idx ) const
+    {
+      return states_.col( idx );
+    }
+
+    ConstCovarianceBlock covariance( unsigned int const & idx ) const
+    {
+      return ConstCovarianceBlock( covs_, 0, idx * __StateDim );
+    }
+
+    int getLabel( unsigned int const & idx ) const { return labels_[ idx ]; }
+    void setLabel( unsigned int const & idx, int const & label ) { labels_[ idx ] = label; }
+
+    /// @return log det of the filter's covariance as of the last predict() (or add(), for a new filter), or infinity if it 
+    /// isn't positive definite. update() does not change it.
+    __NumericType getLogDet( unsigned int const & idx ) const { return log_dets_[ idx ]; }
+    
+    /** 
+     * Predict every filter with no control input: state = A * state, cov = A * cov * A^T + control_cov.
+     * Covariances are assumed to be symmetric, so that cov * A^T can be read off of (A * cov)^T.
+     */
+    void predict( StateMatrix const & A, StateMatrix const & control_cov )
+    {
+      if( size_ == 0 )
+	return;
+
+      int const cov_cols = size_ * __StateDim;
+      
+      product_.leftCols( size_ ).noalias() = A * states_.leftCols( size_ );
+      states_.leftCols( size_ ) = product_.leftCols( size_ );
+      
+      /// [ A P_0, A P_1, ... ], then [ P_0 A^T, P_1 A^T, ... ], then [ A P_0 A^T, A P_1 A^T, ... ]
+      product_.leftCols( cov_cols ).noalias() = A * covs_.leftCols( cov_cols );
+      for(unsigned int idx = 0; idx < size_; ++idx )
+	covs_.template middleCols<__StateDim>( idx * __StateDim ) = product_.template middleCols<__StateDim>( idx * __StateDim ).transpose();
+      product_.leftCols( cov_cols ).noalias() = A * covs_.leftCols( cov_cols );
+      
+      for(unsigned int idx = 0; idx < size_; ++idx )
+	{
+	  covs_.template middleCols<__StateDim>( idx * __StateDim ) = product_.template middleCols<__StateDim>( idx * __StateDim ) + control_cov;
+	  refreshLogDet( idx );
+	}
+    }
+
+    /** 
+     * Measurement update of one filter. The covariance is symmetrized afterwards, since predict() relies on it being
+     * symmetric and (I - K C) P only is up to rounding.
+     */
+    template< unsigned int __UpdateDim>
+    void update( unsigned int const & idx,
+		 typename Update<__UpdateDim>::VectorType const & update,
+		 typename Update<__UpdateDim>::CovarianceType const & update_cov,
+		 typename Update<__UpdateDim>::TransitionType const & C )
+    {
+      auto state = states_.col( idx );
+      auto cov = covs_.template middleCols<__StateDim>( idx * __StateDim );
+
+      typename Update<__UpdateDim>::GainType const cov_ct = cov * C.transpose();
+      typename Update<__UpdateDim>::CovarianceType const innovation_cov = C * cov_ct + update_cov;
+      /// Same gain as LinearKalmanFilter::update()
+      typename Update<__UpdateDim>::GainType const gain = cov_ct * innovation_cov.inverse();
+      
+      state += gain * ( update - C * state );
+      StateMatrix const updated_cov = ( StateMatrix::Identity() - gain * C ) * cov;
+      cov = 0.5 * ( updated_cov + updated_cov.transpose() );
+    }
+
+    /** 
+     * Remove every filter for which remove( idx ) is true, keeping the others in order. Storage is not reallocated.
+     * 
+     * @param remove Called once per filter, in order, with the filter's index before compaction
+     * @return Number of filters removed
+     */
+    template<class __Predicate>
+    unsigned int removeIf( __Predicate remove )
+    {
+      unsigned int kept = 0;
+      for(unsigned int idx = 0; idx < size_; ++idx )
+	{
+	  if( remove( idx ) )
+	    continue;
+
+	  if( kept != idx )
+	    {
+	      states_.col( kept ) = states_.col( idx );
+	      covs_.template middleCols<__StateDim>( kept * __StateDim ) = covs_.template middleCols<__StateDim>( idx * __StateDim );
+	      log_dets_[ kept ] = log_dets_[ idx ];
+	      labels_[ kept ] = labels_[ idx ];
+	    }
+	  ++kept;
+	}
+
+      unsigned int const removed = size_ - kept;
+      size_ = kept;
+      return removed;
+    }
+    
+    private:
+    template<class __LLT>
+    static __NumericType logDet( __LLT const & llt )
+    {
+      /// log det( L L^T ) = 2 sum log L_ii
+      return 2 * llt.matrixLLT().diagonal().array().log().sum();
+    }
+    
+    void refreshLogDet( unsigned int const & idx )
+    {
+      Eigen::LLT<StateMatrix> const llt( covs_.template middleCols<__StateDim>( idx * __StateDim ) );
+      log_dets_[ idx ] = ( llt.info() == Eigen::Success ) ? logDet( llt ) : std::numeric_limits<__NumericType>::infinity();
+    }
+    
+    };
+ 
+}
+
+#endif // USCAUV_OBJECTTRACKING_KALMANFILTERBANK
@@ -59,16 +59,21 @@
 #include <auv_msgs/MatchedShapeArray.h>
 #include <auv_msgs/TrackedObject.h>
 #include <auv_msgs/TrackedObjectArray.h>
+#include <auv_msgs/ImageRegionArray.h>
 
 #include <cmath>
+#include <limits>
 #include <map>
 #include <unordered_set>
 
 /// linalg
-#include <Eigen/LU>
+#include <Eigen/Cholesky>
+#include <Eigen/Eigenvalues>
 
 /// object tracking
 #include <object_tracking/kalman_filter.h>
+#include <object_tracking/kalman_filter_bank.h>
+#include <object_tracking/assignment.h>
 #include <object_tracking/TrackedObjectConfig.h>
 #include <object_tracking/ObjectTrackerConfig.h>
 
@@ -84,6 +89,9 @@ typedef auv_msgs::TrackedObjectArray _TrackedObjectArrayMsg;
 
 typedef sensor_msgs::CameraInfo _CameraInfo;
 
+typedef auv_msgs::ImageRegion _ImageRegionMsg;
+typedef auv_msgs::ImageRegionArray _ImageRegionArrayMsg;
+
 typedef std::map<std::string, XmlRpc::XmlRpcValue> _NamedXmlMap;
 typedef XmlRpc::XmlRpcValue _XmlVal;
 
@@ -98,21 +106,16 @@ typedef _ObjectKalmanFilter::Update<4>  _PositionUpdate;
 /// For using estimates from optical flow - not implemented yet
 typedef _ObjectKalmanFilter::Update<2>  _FlowVelocityUpdate;
 
+/// Every filter of an object, stored together. Each filter's label is the id of its interned color.
+typedef uscauv::LinearKalmanFilterBank<8> _ObjectKalmanFilterBank;
+
 typedef std::unordered_set<std::string> _ColorSet;
 
 /// TODO: Sort filters_ based on uncertainty
 
-struct FilterStorage
-{
-  _ObjectKalmanFilter filter_;
-  std::string color_;
-};
-
-typedef std::vector<FilterStorage> _KalmanFilterVector;
-
 struct ObjectTrackerStorage
 {
-  std::vector<FilterStorage> filters_;
+  _ObjectKalmanFilterBank filters_;
   double ideal_radius_;
   
   std::string type_;
@@ -129,24 +132,55 @@ typedef std::pair<_ShapeTrackerMap::iterator, _ShapeTrackerMap::iterator> _Shape
 
 typedef std::map<std::string, ObjectTrackerStorage> _NamedTrackerMap;
 
+/// A measurement from one shape, reprojected for one of the trackers that could have produced it
+struct TrackerMeasurement
+{
+  _PositionUpdate::VectorType mean_;
+  /// Interned color
+  int color_;
+};
+
+typedef std::map<std::string, std::vector<TrackerMeasurement> > _NamedMeasurementMap;
+
+/// A filter's predicted measurement and innovation covariance, factored once per message so that scoring a measurement is one triangular solve
+struct PositionInnovation
+{
+  _PositionUpdate::VectorType mean_;
+  Eigen::LLT<_PositionUpdate::CovarianceType> llt_;
+  double log_det_;
+  /// False if the covariance isn't positive definite, in which case nothing can associate with the filter
+  bool valid_;
+};
+
+static void computePositionInnovation( _ObjectKalmanFilterBank const & filters, unsigned int const & idx, 
+				       _PositionUpdate::TransitionType const & transition, PositionInnovation & innovation )
+{
+  innovation.mean_ = transition * filters.state( idx );
+  innovation.llt_.compute( transition * filters.covariance( idx ) * transition.transpose() );
+  innovation.valid_ = ( innovation.llt_.info() == Eigen::Success );
+  
+  /// log det( L L^T ) = 2 sum log L_ii
+  innovation.log_det_ = 0;
+  if( innovation.valid_ )
+    innovation.log_det_ = 2 * innovation.llt_.matrixLLT().diagonal().array().log().sum();
+}
+
 /** 
- * Gaussian pdf, but we take the modulus of term 4 because it's a rotatation.
+ * Negative log of the Gaussian pdf, but we take the modulus of term 4 because it's a rotatation.
  * We include the determinant because we want to compare probabilities for
  * different filters with different covariances. The 2pi term is unneccessary
  */
-static double getGaussianPDFPosition(_PositionUpdate::VectorType x,
-				     _PositionUpdate::VectorType mean, 
-				     _PositionUpdate::CovarianceType cov,
-				     double const & yaw_symmetry )
+static double getGaussianNLLPosition( _PositionUpdate::VectorType const & x, PositionInnovation const & innovation, 
+				      double const & yaw_symmetry )
 {
-  _PositionUpdate::VectorType diff_term = x - mean;
+  _PositionUpdate::VectorType diff_term = x - innovation.mean_;
   diff_term(3) = uscauv::ring_distance<double>( diff_term(3), 0, yaw_symmetry );
 
-  /// mahalanobis distance
-  double const md = diff_term.transpose() * cov.inverse() * diff_term;
-  double const det = Eigen::PartialPivLU<_PositionUpdate::CovarianceType>(cov).determinant();
+  /// mahalanobis distance, with L^-1 diff computed by forward substitution
+  _PositionUpdate::VectorType const whitened = innovation.llt_.matrixL().solve( diff_term );
+  double const md = whitened.squaredNorm();
   
-  return exp(-0.5*md) / sqrt( pow(uscauv::TWO_PI, 4)*det );
+  return 0.5 * ( md + innovation.log_det_ );
 }
 
 /// TODO: Add support for start/stop/reset tracking service
@@ -156,13 +190,14 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
   /// ros
   ros::NodeHandle nh_rel_;
   ros::Subscriber matched_shape_sub_, camera_info_sub_;
-  ros::Publisher tracked_object_pub_;
+  ros::Publisher tracked_object_pub_, region_pub_;
   tf::TransformBroadcaster object_broadcaster_;
   tf::TransformListener tf_listener_;
   
   std::string const object_ns_;
   std::string depth_method_;
   std::string motion_frame_;
+  double region_sigma_;
 
   _ObjectTrackerConfig config_;
 
@@ -174,6 +209,9 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
   _ShapeTrackerMap shape_tracker_map_;
   _NamedTrackerMap trackers_;
   _PositionUpdate::TransitionType measurement_transition_;
+  /// Filters store colors as indices into color_names_
+  std::vector<std::string> color_names_;
+  std::map<std::string, int> color_ids_;
 
   /// other
   _CameraInfo last_camera_info_;
@@ -188,7 +226,8 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 
   /** 
    * For each matched shape corresponding to a tracked object, reproject to 3d and use
-   * as a measurement update for the object's kalman filter
+   * as a measurement update for the object's kalman filter. Measurements are associated with
+   * each tracker's filters all at once, see associateMeasurements().
    * 
    * @param msg WHat it is
    */
@@ -200,7 +239,24 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	return;
       }
 
-        
+    if( !camera_model_.initialized() )
+      {
+	ROS_WARN( "Camera model is not ready.");
+	return;
+      }
+
+    if( depth_method_ != "monocular" )
+      {
+	ROS_ERROR("Bad depth method.");
+	return;
+      }
+
+    // ################################################################
+    // Project to 3d ##################################################
+    // ################################################################
+
+    _NamedMeasurementMap tracker_measurements;
+    
     for( std::vector<_MatchedShape>::const_iterator shape_it= msg->shapes.begin();
 	 shape_it != msg->shapes.end(); ++shape_it)
       {
@@ -211,15 +267,10 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	if( match_range.first == match_range.second ) continue;
 
 
-	/// Process the measurement for each compatible tracker
+	/// Reproject the measurement for each compatible tracker
 	for( _ShapeTrackerMap::iterator tracker_it = match_range.first; tracker_it != match_range.second;
 	     ++tracker_it )
 	  {
-	    
-	    // ################################################################
-	    // Project to 3d ##################################################
-	    // ################################################################
-
 	    _NamedTrackerMap::iterator tracker = trackers_.find( tracker_it->second );
 
 	    // Shouldn't happen - shape_tracker_map should only contain names of trackers in the map trackers_
@@ -231,88 +282,167 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	    if( storage.colors_.find( shape_it->color ) == storage.colors_.end() )
 	      continue;
 	    
-	    tf::Vector3 camera_to_object_vec;	
-
-	    if( !camera_model_.initialized() )
-	      {
-		ROS_WARN( "Camera model is not ready.");
-		return;
-	      }
+	    tf::Vector3 const camera_to_object_vec = 
+	      uscauv::reprojectObjectTo3d( camera_model_, cv::Point2d( shape_it->x, shape_it->y),
+					   shape_it->scale, storage.ideal_radius_ );
 
-	    if( depth_method_ == "monocular" )
-	      {
-		camera_to_object_vec = 
-		  uscauv::reprojectObjectTo3d( camera_model_, cv::Point2d( shape_it->x, shape_it->y),
-					       shape_it->scale, storage.ideal_radius_ );
-	      }
-	    else
-	      {
-		ROS_ERROR("Bad depth method.");
-		return;
-	      }
-	
-	    // ################################################################
-	    // Update filter ##################################################
-	    // ################################################################
-
-	    /// Get measurement update params, then update
-	    _PositionUpdate::VectorType update_mean;
-	    update_mean << 
+	    TrackerMeasurement measurement;
+	    measurement.mean_ << 
 	      camera_to_object_vec.x(),
 	      camera_to_object_vec.y(), 
 	      camera_to_object_vec.z(),
 	      shape_it->theta;
-
-	    int idx = 0;
-	    int max_idx = -1;
-	    double max_prob = 0;
-	    _KalmanFilterVector & filters = storage.filters_;
-	    int neighbors = 0;
-	    for(_KalmanFilterVector::iterator filter_it = filters.begin(); filter_it != filters.end();
-		++filter_it, ++idx )
-	      {
-		_ObjectKalmanFilter & filter = filter_it->filter_;
-		
-		_PositionUpdate::VectorType state_pos = measurement_transition_*filter.state_;
-		_PositionUpdate::VectorType diff_term = state_pos - update_mean;
-
-		double const d = getGaussianPDFPosition( update_mean, state_pos, measurement_transition_ * filter.cov_ * measurement_transition_.transpose(), storage.config_.symmetry );
-		double const dist_euclidian = diff_term.block(0,0,3,1).norm();
-		double const dist_angular = uscauv::ring_distance<double>( diff_term(3), 0, storage.config_.symmetry );
-		ROS_DEBUG("PDF val: %0.20f, dist: %f, angle %f", d, dist_euclidian, dist_angular);
-
-		if( dist_euclidian <= storage.config_.exclude_distance
-		    && dist_angular <= storage.config_.exclude_angle
-		    && d > max_prob )
-		  {
-		    max_prob = d;
-		    max_idx = idx;
-		    neighbors++;
-		  }	    
-	      }
-	    ROS_DEBUG("Found %d neighbor filters.", neighbors);
-	    /// Spawn a new filter if none of the current filters are a good match for the measurement
-	    if( max_idx == -1 )
-	      {
-		_ObjectKalmanFilter::StateVector initial_state = measurement_transition_.transpose() * update_mean;
-
-		FilterStorage new_filter;
-		new_filter.filter_ = _ObjectKalmanFilter( initial_state, initial_cov_ );
-		new_filter.color_ = shape_it->color;
-
-		storage.filters_.push_back( new_filter );
-		ROS_DEBUG_STREAM("Spawned filter ( " << initial_state.transpose() << " ).");
-	      }
-	    else
-	      {
-		FilterStorage & updated_filter = storage.filters_.at(max_idx);
-		updated_filter.filter_.update<4>( update_mean, update_cov_, measurement_transition_ );
-		updated_filter.color_ = shape_it->color;
-	      }
+	    measurement.color_ = internColor( shape_it->color );
 	    
+	    tracker_measurements[ tracker->first ].push_back( measurement );
 	  } // matched trackers
       } // matched shapes
+
+    // ################################################################
+    // Update filters #################################################
+    // ################################################################
+
+    for( _NamedMeasurementMap::value_type const & element : tracker_measurements )
+      associateMeasurements( trackers_.at( element.first ), element.second );
+    
   } //callback
+
+  /** 
+   * Global nearest neighbor association of one message's measurements with a tracker's filters. Each filter's
+   * innovation covariance is factored once, every gated (measurement, filter) pair is scored by its negative log
+   * likelihood, and the assignment that updates the most filters, with the highest total likelihood among those, is
+   * solved for. A filter is updated by at most one measurement per message. Measurements that fall outside every
+   * filter's gate spawn new filters. Measurements that were gated by some filter but lost it to another measurement
+   * are dropped, since they most likely belong to an object that is already being tracked.
+   */
+  void associateMeasurements( ObjectTrackerStorage & storage, std::vector<TrackerMeasurement> const & measurements )
+  {
+    _ObjectKalmanFilterBank & filters = storage.filters_;
+    int const measurement_count = measurements.size(), filter_count = filters.size();
+
+    std::vector<PositionInnovation> innovations( filter_count );
+    for(int filter_idx = 0; filter_idx < filter_count; ++filter_idx )
+      computePositionInnovation( filters, filter_idx, measurement_transition_, innovations[ filter_idx ] );
+
+    /// Gated pairs get their NLL. Everything else is NaN until the gate cost is known.
+    Eigen::MatrixXd cost = Eigen::MatrixXd::Constant( measurement_count, filter_count + measurement_count, 
+						      std::numeric_limits<double>::quiet_NaN() );
+    double min_cost = std::numeric_limits<double>::max(), max_cost = -min_cost;
+    int neighbors = 0;
+    /// Whether each measurement fell inside any filter's gate
+    std::vector<bool> gated( measurement_count, false );
+    
+    for(int measurement_idx = 0; measurement_idx < measurement_count; ++measurement_idx )
+      for(int filter_idx = 0; filter_idx < filter_count; ++filter_idx )
+	{
+	  PositionInnovation const & innovation = innovations[ filter_idx ];
+	  _PositionUpdate::VectorType const & update_mean = measurements[ measurement_idx ].mean_;
+	  if( !innovation.valid_ )
+	    continue;
+	  
+	  _PositionUpdate::VectorType const diff_term = innovation.mean_ - update_mean;
+	  double const dist_euclidian = diff_term.block(0,0,3,1).norm();
+	  double const dist_angular = uscauv::ring_distance<double>( diff_term(3), 0, storage.config_.symmetry );
+	  if( dist_euclidian > storage.config_.exclude_distance || dist_angular > storage.config_.exclude_angle )
+	    continue;
+	  
+	  double const nll = getGaussianNLLPosition( update_mean, innovation, storage.config_.symmetry );
+	  ROS_DEBUG("NLL: %f, dist: %f, angle %f", nll, dist_euclidian, dist_angular);
+	  if( !std::isfinite( nll ) )
+	    continue;
+	  
+	  cost( measurement_idx, filter_idx ) = nll;
+	  min_cost = std::min( min_cost, nll );
+	  max_cost = std::max( max_cost, nll );
+	  gated[ measurement_idx ] = true;
+	  ++neighbors;
+	}
+    ROS_DEBUG("Found %d gated measurement-filter pairs.", neighbors);
+
+    /// Shift gated costs to [0, range]. Each measurement has its own "unassigned" column. Leaving a measurement
+    /// unassigned costs more than measurement_count gated pairs can, so no assignment with fewer pairs is ever
+    /// cheaper. Ungated pairs cost more still, so they are never picked over the unassigned column.
+    double const range = ( neighbors > 0 ) ? max_cost - min_cost : 0;
+    double const unassigned_cost = measurement_count * range + 1;
+    double const ungated_cost = unassigned_cost + 1;
+    for(int measurement_idx = 0; measurement_idx < measurement_count; ++measurement_idx )
+      for(int col = 0; col < filter_count + measurement_count; ++col )
+	{
+	  double & entry = cost( measurement_idx, col );
+	  if( col == filter_count + measurement_idx )
+	    entry = unassigned_cost;
+	  else if( std::isnan( entry ) )
+	    entry = ungated_cost;
+	  else
+	    entry -= min_cost;
+	}
+
+    std::vector<int> assignment;
+    uscauv::solveAssignment( cost, assignment );
+
+    /// Scoring used the predicted filters, so nothing is updated until every pair has been scored
+    std::vector<int> unassigned;
+    for(int measurement_idx = 0; measurement_idx < measurement_count; ++measurement_idx )
+      {
+	int const filter_idx = assignment[ measurement_idx ];
+	TrackerMeasurement const & measurement = measurements[ measurement_idx ];
+	
+	if( filter_idx >= filter_count )
+	  {
+	    if( gated[ measurement_idx ] )
+	      ROS_DEBUG( "Dropped measurement that was outbid for every filter gating it." );
+	    else
+	      unassigned.push_back( measurement_idx );
+	    continue;
+	  }
+	
+	filters.update<4>( filter_idx, measurement.mean_, update_cov_, measurement_transition_ );
+	filters.setLabel( filter_idx, measurement.color_ );
+      }
+
+    /// Spawn a new filter if none of the current filters are a good match for the measurement. Several ungated
+    /// measurements of the same new object update the filter that the first of them spawned.
+    int const first_spawned = filters.size();
+    for( int const measurement_idx : unassigned )
+      {
+	TrackerMeasurement const & measurement = measurements[ measurement_idx ];
+
+	int spawned_idx = -1;
+	for(int filter_idx = first_spawned; filter_idx < int( filters.size() ) && spawned_idx == -1; ++filter_idx )
+	  {
+	    _PositionUpdate::VectorType const diff_term = measurement_transition_ * filters.state( filter_idx ) - measurement.mean_;
+	    if( diff_term.block(0,0,3,1).norm() <= storage.config_.exclude_distance
+		&& uscauv::ring_distance<double>( diff_term(3), 0, storage.config_.symmetry ) <= storage.config_.exclude_angle )
+	      spawned_idx = filter_idx;
+	  }
+
+	if( spawned_idx == -1 )
+	  {
+	    _ObjectKalmanFilter::StateVector initial_state = measurement_transition_.transpose() * measurement.mean_;
+
+	    filters.add( initial_state, initial_cov_, measurement.color_ );
+	    ROS_DEBUG_STREAM("Spawned filter ( " << initial_state.transpose() << " ).");
+	  }
+	else
+	  {
+	    filters.update<4>( spawned_idx, measurement.mean_, update_cov_, measurement_transition_ );
+	    filters.setLabel( spawned_idx, measurement.color_ );
+	  }
+      }
+  }
+  
+  /// @return Small integer id for the color, assigned the first time it is seen
+  int internColor( std::string const & color )
+  {
+    std::map<std::string, int>::const_iterator id_it = color_ids_.find( color );
+    if( id_it != color_ids_.end() )
+      return id_it->second;
+
+    int const id = color_names_.size();
+    color_names_.push_back( color );
+    color_ids_[ color ] = id;
+    return id;
+  }
   
   /// cache camera info
   void cameraInfoCallback( _CameraInfo::ConstPtr const & msg )
@@ -371,9 +501,13 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 					 this);
 
     tracked_object_pub_ = nh_base.advertise<_TrackedObjectArrayMsg>("robot/sensors/tracked_objects", 10);
+    /// Where each object should show up in the next frame, so that the vision nodes can skip the rest of it
+    region_pub_ = nh_rel_.advertise<_ImageRegionArrayMsg>("image_regions", 1);
 
     depth_method_ = uscauv::param::load<std::string>( nh_rel_, "depth_method", "monocular" );
     motion_frame_ = uscauv::param::load<std::string>( nh_rel_, "motion_frame", uscauv::defaults::CM_LINK );
+    /// Image regions cover this many standard deviations of position uncertainty
+    region_sigma_ = uscauv::param::load<double>( nh_rel_, "region_sigma", 3.0 );
     
     /// TODO: Add more depth methods
     if( depth_method_ != "monocular" )
@@ -441,6 +575,29 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 
     std::vector< tf::StampedTransform > object_transforms;
     _TrackedObjectArrayMsg tracked_objects;
+
+    _ImageRegionArrayMsg regions;
+    regions.header.frame_id = last_camera_info_.header.frame_id;
+    regions.header.stamp = ros::Time::now();
+    regions.image_rows = last_camera_info_.height;
+    regions.image_cols = last_camera_info_.width;
+
+    /// get the transform from the motion frame (CM on the physical robot) to the camera frame. This is the same for every filter.
+    /// Without it we still predict and publish image regions, since those are in the camera frame.
+    tf::StampedTransform motion_to_observer_tf;
+    bool have_motion_tf = false;
+    if( tf_listener_.canTransform( motion_frame_, last_camera_info_.header.frame_id, ros::Time(0) ))
+      {
+	try
+	  {
+	    tf_listener_.lookupTransform( motion_frame_, last_camera_info_.header.frame_id, ros::Time(0), motion_to_observer_tf );
+	    have_motion_tf = true;
+	  }
+	catch(tf::TransformException & ex)
+	  {
+	    ROS_ERROR( "Caught exception [ %s ] looking up transform", ex.what() );
+	  }
+      }
     
     for( _NamedTrackerMap::iterator tracker_it = trackers_.begin(); tracker_it != trackers_.end();
 	 ++tracker_it)
@@ -463,52 +620,59 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	// Remove filters whose variance exceeds a threshold ##############
 	// ################################################################
 
-	int idx = 0;
+	_ObjectKalmanFilterBank & filters = storage.filters_;
+	
+	/// no control input. Every filter of the object is predicted at once.
+	filters.predict( state_transition, control_cov_ );
+
+	/// Compared in log space, since determinants of 8x8 covariances overflow easily
+	double const log_kill_var = std::log( config_.kill_var );
+	filters.removeIf( [&filters, log_kill_var]( unsigned int const & filter_idx )
+			  {
+			    if( filters.getLogDet( filter_idx ) <= log_kill_var )
+			      return false;
+			    
+			    ROS_DEBUG_STREAM("Killed filter ( " << filters.state( filter_idx ).transpose() << " ) Det: " 
+					     << std::exp( filters.getLogDet( filter_idx ) ) << ".");
+			    return true;
+			  } );
+
 	int min_idx = 0;
-	double min_det = -1;
-	_KalmanFilterVector & filters = storage.filters_;
-	_KalmanFilterVector surviving_filters;
-	for(_KalmanFilterVector::iterator filter_it = filters.begin(); filter_it != filters.end();
-	    ++filter_it )
+	for(unsigned int filter_idx = 1; filter_idx < filters.size(); ++filter_idx )
+	  if( filters.getLogDet( filter_idx ) < filters.getLogDet( min_idx ) )
+	    min_idx = filter_idx;
+
+	// ################################################################
+	// Predict where each filter will show up in the image ############
+	// ################################################################
+
+	for(unsigned int filter_idx = 0; filter_idx < filters.size(); ++filter_idx )
 	  {
-	    _ObjectKalmanFilter & filter = filter_it->filter_;
-	    
-	    /// no control input
-	    filter.predict<8>( _FullStateControl::VectorType::Zero(),
-				   control_cov_, state_transition );
+	    cv::Rect region;
+	    if( projectFilterRegion( filters.state( filter_idx ), filters.covariance( filter_idx ), storage.ideal_radius_, region ) )
+	      continue;
 	    
-	    double const det = Eigen::PartialPivLU<_ObjectKalmanFilter::StateMatrix>( filter.cov_ ).determinant();
-	    if( det <= config_.kill_var )
-	      {
-	
-		surviving_filters.push_back( *filter_it );
-		
-		if( det < min_det || min_det < 0 )
-		  {
-		    min_det = det;
-		    min_idx = idx;
-		  }
-		++idx;
-	      }
-	    else
-	      {
-		ROS_DEBUG_STREAM("Killed filter ( " << filter.state_.transpose() << " ) Det: " << det << ".");
-	      }
+	    _ImageRegionMsg region_msg;
+	    region_msg.x = region.x;
+	    region_msg.y = region.y;
+	    region_msg.width = region.width;
+	    region_msg.height = region.height;
+	    region_msg.type = storage.type_;
+	    region_msg.color = color_names_[ filters.getLabel( filter_idx ) ];
+	    regions.regions.push_back( region_msg );
 	  }
-	storage.filters_ = surviving_filters;
+
+	if( !have_motion_tf )
+	  continue;
 	    
 	// ################################################################
 	// Publish filter estimates. Lowest variance filter gets primary tf
 	// ################################################################
 	
-	idx = 0;
 	int aux_idx = 0;    
-	for(_KalmanFilterVector::iterator filter_it = filters.begin(); filter_it != filters.end();
-	    ++filter_it, ++idx)
+	for(int idx = 0; idx < int( filters.size() ); ++idx)
 	  {
-	    _ObjectKalmanFilter & filter = filter_it->filter_;
-	    
-	    _ObjectKalmanFilter::StateVector const & state = filter.state_;
+	    _ObjectKalmanFilter::StateVector const state = filters.state( idx );
 	    
 	    tf::Vector3 observer_to_object_vec = tf::Vector3( state(0), state(1), state(2) );
 	    /// setRPY uses R=around X, P=around Y, Y=around Z, so we are rotating around Z
@@ -518,24 +682,6 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	    tf::Transform observer_to_object_tf = tf::Transform( observer_to_object_quat,
 								 observer_to_object_vec );
 	    
-	    tf::StampedTransform motion_to_observer_tf;
-
-	    /// get the transform from the motion frame (CM on the physical robot) to the camera frame
-	    if( tf_listener_.canTransform( motion_frame_, last_camera_info_.header.frame_id, ros::Time(0) ))
-	      {
-		try
-		  {
-		    tf_listener_.lookupTransform( motion_frame_, last_camera_info_.header.frame_id, ros::Time(0), motion_to_observer_tf );
-		  }
-		catch(tf::TransformException & ex)
-		  {
-		    ROS_ERROR( "Caught exception [ %s ] looking up transform", ex.what() );
-		    return;
-		  }
-	      }
-	    else 
-	      return;
-
 	    tf::Transform motion_to_object_tf = motion_to_observer_tf * observer_to_object_tf;
 
 	    std::string frame_name;
@@ -551,14 +697,13 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 	      }
 
 	    /// Add TrackedObject msg for object
-	    /// TODO: Don't recalulate det, add color, add children, add covariance for pose
-	    double const det = Eigen::PartialPivLU<_ObjectKalmanFilter::StateMatrix>( filter.cov_ ).determinant();
-	    if( det <= config_.pass_var )
+	    /// TODO: add children, add covariance for pose
+	    if( filters.getLogDet( idx ) <= std::log( config_.pass_var ) )
 	      {
 		_TrackedObjectMsg object;
-		object.variance = det;
+		object.variance = std::exp( filters.getLogDet( idx ) );
 		object.symmetry = storage.config_.symmetry;
-		object.color = filter_it->color_;
+		object.color = color_names_[ filters.getLabel( idx ) ];
 		object.type = storage.type_;
 
 		object.header.frame_id = motion_frame_;
@@ -588,10 +733,77 @@ class UnimodalObjectTrackerNode: public BaseNode, public MultiReconfigure
 
       }
 
+    region_pub_.publish( regions );
+    
+    if( !have_motion_tf )
+      return;
+    
     tracked_object_pub_.publish( tracked_objects );
     object_broadcaster_.sendTransform( object_transforms );
     return;
   }
+
+  /** 
+   * Project the filter's position uncertainty into the image. The region bounds the object, of the given radius,
+   * placed at the ends of every principal axis of the region_sigma_ ellipsoid.
+   * 
+   * @param state Filter state, in the camera frame
+   * @param cov Filter covariance
+   * @param object_radius Radius of the object in meters
+   * @param region Output region, clipped to the image
+   * 
+   * @return 0 on success, -1 if the object can't be in the image
+   */
+  int projectFilterRegion( _ObjectKalmanFilter::StateVector const & state, _ObjectKalmanFilter::StateMatrix const & cov, 
+			   double const & object_radius, cv::Rect & region )
+  {
+    /// Anything closer than this is treated as possibly anywhere in the image
+    static double const MIN_DEPTH = 0.05;
+    
+    cv::Rect const frame( 0, 0, last_camera_info_.width, last_camera_info_.height );
+    
+    Eigen::Vector3d const mean( state(0), state(1), state(2) );
+    if( mean.z() < MIN_DEPTH )
+      return -1;
+
+    Eigen::Matrix3d const position_cov = cov.block<3,3>(0,0);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> const solver( position_cov );
+    
+    double min_x = std::numeric_limits<double>::max(), min_y = min_x;
+    double max_x = -min_x, max_y = -min_x;
+
+    for(int axis = 0; axis < 3; ++axis )
+      {
+	Eigen::Vector3d const offset = region_sigma_ * std::sqrt( std::max( 0.0, solver.eigenvalues()( axis ) ) ) * solver.eigenvectors().col( axis );
+	
+	for(int sign = -1; sign <= 1; sign += 2 )
+	  {
+	    Eigen::Vector3d const point = mean + sign * offset;
+	    if( point.z() < MIN_DEPTH )
+	      {
+		region = frame;
+		return 0;
+	      }
+	    
+	    cv::Point2d const pixel = camera_model_.project3dToPixel( cv::Point3d( point.x(), point.y(), point.z() ) );
+	    double const radius = camera_model_.fx() * object_radius / point.z();
+	    
+	    min_x = std::min( min_x, pixel.x - radius );
+	    max_x = std::max( max_x, pixel.x + radius );
+	    min_y = std::min( min_y, pixel.y - radius );
+	    max_y = std::max( max_y, pixel.y + radius );
+	  }
+      }
+
+    /// Clamp before converting so that huge regions don't overflow
+    min_x = std::max( min_x, -1.0 ); min_y = std::max( min_y, -1.0 );
+    max_x = std::min( max_x, frame.width + 1.0 ); max_y = std::min( max_y, frame.height + 1.0 );
+    
+    int const x0 = std::floor( min_x ), y0 = std::floor( min_y );
+    region = cv::Rect( x0, y0, std::ceil( max_x ) - x0, std::ceil( max_y ) - y0 ) & frame;
+    
+    return region.area() > 0 ? 0 : -1;
+  }
     
 };
     
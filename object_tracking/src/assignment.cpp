@@ -0,0 +1,133 @@
+/***************************************************************************
+ *  src/assignment.cpp
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <object_tracking/assignment.h>
+
+/// cpp11
+#include <limits>
+
+namespace uscauv
+{
+
+  double solveAssignment( Eigen::MatrixXd const & cost, std::vector<int> & assignment )
+  {
+    int const rows = cost.rows(), cols = cost.cols();
+    assignment.assign( rows, -1 );
+    if( rows == 0 )
+      return 0;
+    
+    eigen_assert( rows <= cols );
+    
+    double const infinity = std::numeric_limits<double>::infinity();
+
+    /// Row and column potentials, and the row matched to each column. Index 0 is a sentinel, so rows and columns are 1-based.
+    std::vector<double> row_potential( rows + 1, 0 ), col_potential( cols + 1, 0 );
+    std::vector<int> col_match( cols + 1, 0 ), previous_col( cols + 1, 0 );
+    std::vector<double> min_slack( cols + 1 );
+    std::vector<bool> visited( cols + 1 );
+    
+    for(int row = 1; row <= rows; ++row )
+      {
+	/// Grow an alternating tree from the sentinel column until it reaches a free column
+	col_match[ 0 ] = row;
+	int col = 0;
+	std::fill( min_slack.begin(), min_slack.end(), infinity );
+	std::fill( visited.begin(), visited.end(), false );
+	
+	do
+	  {
+	    visited[ col ] = true;
+	    int const tree_row = col_match[ col ];
+	    double delta = infinity;
+	    int next_col = 0;
+	    
+	    for(int candidate = 1; candidate <= cols; ++candidate )
+	      {
+		if( visited[ candidate ] )
+		  continue;
+		
+		double const slack = cost( tree_row - 1, candidate - 1 ) - row_potential[ tree_row ] - col_potential[ candidate ];
+		if( slack < min_slack[ candidate ] )
+		  {
+		    min_slack[ candidate ] = slack;
+		    previous_col[ candidate ] = col;
+		  }
+		if( min_slack[ candidate ] < delta )
+		  {
+		    delta = min_slack[ candidate ];
+		    next_col = candidate;
+		  }
+	      }
+
+	    for(int candidate = 0; candidate <= cols; ++candidate )
+	      {
+		if( visited[ candidate ] )
+		  {
+		    row_potential[ col_match[ candidate ] ] += delta;
+		    col_potential[ candidate ] -= delta;
+		  }
+		else
+		  min_slack[ candidate ] -= delta;
+	      }
+	    
+	    col = next_col;
+	  }
+	while( col_match[ col ] != 0 );
+
+	/// Flip the augmenting path
+	do
+	  {
+	    int const previous = previous_col[ col ];
+	    col_match[ col ] = col_match[ previous ];
+	    col = previous;
+	  }
+	while( col != 0 );
+      }
+
+    double total = 0;
+    for(int col = 1; col <= cols; ++col )
+      if( col_match[ col ] != 0 )
+	{
+	  assignment[ col_match[ col ] - 1 ] = col - 1;
+	  total += cost( col_match[ col ] - 1, col - 1 );
+	}
+    
+    return total;
+  }
+
+}
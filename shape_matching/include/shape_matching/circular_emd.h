@@ -0,0 +1,184 @@
+/***************************************************************************
+ *  include/shape_matching/circular_emd.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+
+#ifndef USCAUV_SHAPEMATCHING_CIRCULAREMD
+#define USCAUV_SHAPEMATCHING_CIRCULAREMD
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// cpp11
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+/**
+ * Closed form Earth Mover's Distance between two histograms on a circle, where the ground distance between
+ * bins i and j is min( |i-j|, n-|i-j| ). This is the cost that ShapeMatcherNode::circularCostEuclidian() builds.
+ *
+ * On a line, EMD is the L1 norm of the difference of the cumulative histograms. On a circle, any constant
+ * amount of mass c can also flow all the way around, which turns that into min_c sum_k |F_k - c|. The
+ * minimizing c is the median of the F_k, so this is O(n) instead of a transportation problem solve.
+ *
+ * See Rabin, Delon, and Gousseau, "Circular Earth Mover's Distance for the comparison of local features".
+ */
+namespace circular_emd
+{
+  /// Relative difference in total mass past which the closed form no longer applies
+  double const MASS_TOLERANCE = 1e-4;
+
+  /** 
+   * @param signature1 nx1 or 1xn CV_32FC1 histogram, as produced by ShapeMatcherNode::analyzeContour()
+   * @param signature2 Histogram of the same size and type as signature1
+   * @param emd Output EMD, normalized by total mass the same way that cv::EMD() normalizes it
+   * 
+   * @return 0 on success, -1 if the signatures can't be compared in closed form (different sizes or types, 
+   * negative weights, or unequal mass). Use cv::EMD() in that case.
+   */
+  inline int compute( cv::Mat const & signature1, cv::Mat const & signature2, double & emd )
+  {
+    if( signature1.type() != CV_32FC1 || signature2.type() != CV_32FC1 || 
+	signature1.total() != signature2.total() || signature1.total() == 0 ||
+	!signature1.isContinuous() || !signature2.isContinuous() )
+      return -1;
+    
+    int const bins = signature1.total();
+    float const * weights1 = signature1.ptr<float>(0);
+    float const * weights2 = signature2.ptr<float>(0);
+
+    /// Cumulative difference F_k, which is how much mass has to cross the boundary between bins k and k+1
+    std::vector<double> cumulative( bins );
+    double mass1 = 0, mass2 = 0, running = 0;
+    for(int idx = 0; idx < bins; ++idx )
+      {
+	if( weights1[ idx ] < 0 || weights2[ idx ] < 0 )
+	  return -1;
+	
+	mass1 += weights1[ idx ];
+	mass2 += weights2[ idx ];
+	running += weights1[ idx ] - weights2[ idx ];
+	cumulative[ idx ] = running;
+      }
+
+    double const mass = std::min( mass1, mass2 );
+    if( mass <= 0 || std::fabs( mass1 - mass2 ) > MASS_TOLERANCE * std::max( mass1, mass2 ) )
+      return -1;
+
+    /// Any median minimizes the sum of absolute deviations
+    std::vector<double> sorted( cumulative );
+    std::nth_element( sorted.begin(), sorted.begin() + bins / 2, sorted.end() );
+    double const median = sorted[ bins / 2 ];
+    
+    double work = 0;
+    for(int idx = 0; idx < bins; ++idx )
+      work += std::fabs( cumulative[ idx ] - median );
+
+    emd = work / mass;
+    return 0;
+  }
+
+  /// Number of Fourier modes that lowerBound() uses
+  int const BOUND_MODES = 2;
+  
+  /// Low frequency Fourier coefficients of a histogram, normalized by its mass
+  struct Modes
+  {
+    std::complex<double> coefficients_[ BOUND_MODES ];
+    double mass_;
+    int bins_;
+  };
+
+  /** 
+   * @param signature nx1 or 1xn CV_32FC1 histogram
+   * @param modes Output
+   * 
+   * @return 0 on success, -1 if the signature has no mass or is the wrong type
+   */
+  inline int computeModes( cv::Mat const & signature, Modes & modes )
+  {
+    if( signature.type() != CV_32FC1 || !signature.isContinuous() || signature.total() == 0 )
+      return -1;
+
+    int const bins = signature.total();
+    float const * weights = signature.ptr<float>(0);
+
+    modes.bins_ = bins;
+    modes.mass_ = 0;
+    for(int mode = 0; mode < BOUND_MODES; ++mode )
+      modes.coefficients_[ mode ] = 0;
+
+    for(int idx = 0; idx < bins; ++idx )
+      {
+	modes.mass_ += weights[ idx ];
+	for(int mode = 0; mode < BOUND_MODES; ++mode )
+	  modes.coefficients_[ mode ] += double( weights[ idx ] ) * std::polar( 1.0, -2 * M_PI * ( mode + 1 ) * idx / bins );
+      }
+
+    if( !( modes.mass_ > 0 ) )
+      return -1;
+    
+    for(int mode = 0; mode < BOUND_MODES; ++mode )
+      modes.coefficients_[ mode ] /= modes.mass_;
+    
+    return 0;
+  }
+
+  /** 
+   * Lower bound on the circular EMD between two equal mass histograms. For mode m, the function
+   * f(k) = n / (2 pi m) cos( 2 pi m k / n - phi ) changes by at most one per bin of circular distance, so by
+   * Kantorovich-Rubinstein duality EMD >= sum_k f(k) ( p_k - q_k ) for every phase phi. The best phase gives
+   * n / (2 pi m) | P_m - Q_m |.
+   * 
+   * @return The bound, or 0 (which bounds everything) if the histograms aren't comparable
+   */
+  inline double lowerBound( Modes const & modes1, Modes const & modes2 )
+  {
+    if( modes1.bins_ != modes2.bins_ || 
+	std::fabs( modes1.mass_ - modes2.mass_ ) > MASS_TOLERANCE * std::max( modes1.mass_, modes2.mass_ ) )
+      return 0;
+
+    double bound = 0;
+    for(int mode = 0; mode < BOUND_MODES; ++mode )
+      bound = std::max( bound, modes1.bins_ / ( 2 * M_PI * ( mode + 1 ) ) * 
+			std::abs( modes1.coefficients_[ mode ] - modes2.coefficients_[ mode ] ) );
+    return bound;
+  }
+  
+} // circular_emd
+
+#endif // USCAUV_SHAPEMATCHING_CIRCULAREMD
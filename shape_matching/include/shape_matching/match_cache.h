@@ -0,0 +1,167 @@
+/***************************************************************************
+ *  include/shape_matching/match_cache.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+
+#ifndef USCAUV_SHAPEMATCHING_MATCHCACHE
+#define USCAUV_SHAPEMATCHING_MATCHCACHE
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// cpp11
+#include <unordered_map>
+#include <vector>
+#include <cmath>
+
+/**
+ * Remembers which templates a contour matched, keyed on a quantized descriptor of the contour, so that a shape that
+ * sits still in front of the camera is only matched once every few frames. Each color has its own cache, so no locking
+ * is needed.
+ *
+ * Entries expire after a number of frames without a hit, and the whole cache is dropped whenever the templates
+ * it refers to change.
+ */
+template<class __Match>
+class MatchCache
+{
+ public:
+  /// Signature bins are quantized to this fraction of an average bin's weight
+  static int const SIGNATURE_LEVELS = 16;
+  /// Area is quantized to steps of 1/AREA_LEVELS in log space, about 6% 
+  static int const AREA_LEVELS = 16;
+
+ private:
+  struct Entry
+  {
+    uint64_t last_frame_;
+    std::vector<__Match> matches_;
+  };
+
+  std::unordered_map<uint64_t, Entry> entries_;
+  uint64_t frame_;
+  unsigned int generation_;
+
+ public:
+ MatchCache(): frame_( 0 ), generation_( 0 ) {}
+
+  /** 
+   * Call once per frame before any lookups
+   * 
+   * @param frame Frame counter, increasing by one per frame
+   * @param generation Changes whenever the templates change. Everything cached under another generation is dropped.
+   * @param max_age Entries that haven't been hit in this many frames are dropped
+   */
+  void beginFrame( uint64_t const & frame, unsigned int const & generation, unsigned int const & max_age )
+  {
+    frame_ = frame;
+    if( generation != generation_ )
+      {
+	entries_.clear();
+	generation_ = generation;
+	return;
+      }
+
+    for( typename std::unordered_map<uint64_t, Entry>::iterator entry_it = entries_.begin(); entry_it != entries_.end(); )
+      {
+	if( frame_ - entry_it->second.last_frame_ > max_age )
+	  entry_it = entries_.erase( entry_it );
+	else
+	  ++entry_it;
+      }
+  }
+
+  /** 
+   * @return Matches cached under key, or NULL on a miss
+   */
+  std::vector<__Match> const * find( uint64_t const & key )
+  {
+    typename std::unordered_map<uint64_t, Entry>::iterator entry_it = entries_.find( key );
+    if( entry_it == entries_.end() )
+      return NULL;
+
+    entry_it->second.last_frame_ = frame_;
+    return &entry_it->second.matches_;
+  }
+
+  void insert( uint64_t const & key, std::vector<__Match> const & matches )
+  {
+    Entry & entry = entries_[ key ];
+    entry.last_frame_ = frame_;
+    entry.matches_ = matches;
+  }
+
+  void clear()
+  {
+    entries_.clear();
+  }
+  
+  /** 
+   * Hash a contour's quantized centroid, bounding box, area, and signature
+   * 
+   * @param cell Size in pixels of the grid that positions and sizes are snapped to
+   * @param signature nx1 CV_32FC1 signature that sums to one
+   */
+  static uint64_t makeKey( cv::Point2f const & centroid, cv::Rect const & bounding_box, double const & area, 
+			   cv::Mat const & signature, double const & cell )
+  {
+    /// FNV-1a over the quantized values
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash]( int64_t value )
+      {
+	for(int byte = 0; byte < 8; ++byte, value >>= 8 )
+	  {
+	    hash ^= uint64_t( value & 0xff );
+	    hash *= 1099511628211ULL;
+	  }
+      };
+
+    mix( std::floor( centroid.x / cell ) );
+    mix( std::floor( centroid.y / cell ) );
+    mix( std::floor( bounding_box.width / cell ) );
+    mix( std::floor( bounding_box.height / cell ) );
+    mix( std::floor( std::log( 1 + std::max( 0.0, area ) ) * AREA_LEVELS ) );
+
+    int const bins = signature.total();
+    float const * weights = signature.ptr<float>(0);
+    mix( bins );
+    for(int bin = 0; bin < bins; ++bin )
+      mix( std::lround( weights[ bin ] * bins * SIGNATURE_LEVELS ) );
+
+    return hash;
+  }
+};
+
+#endif // USCAUV_SHAPEMATCHING_MATCHCACHE
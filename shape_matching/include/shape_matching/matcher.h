@@ -0,0 +1,862 @@
+/***************************************************************************
+ *  include/shape_matching/matcher.h    
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+
+#ifndef USCAUV_SHAPEMATCHING_MATCHER
+#define USCAUV_SHAPEMATCHING_MATCHER
+
+// ROS
+#include <ros/console.h>
+
+// uscauv
+#include <uscauv_common/graphics.h>
+#include <uscauv_common/color_codec.h>
+#include <uscauv_common/simple_math.h>
+#include <uscauv_common/worker_pool.h>
+
+/// opencv
+#include <opencv2/imgproc/imgproc.hpp>
+
+/// cpp11
+#include <atomic>
+#include <memory>
+
+/// shape_matching
+#include <shape_matching/circular_emd.h>
+#include <shape_matching/template_index.h>
+#include <shape_matching/match_cache.h>
+#include <shape_matching/denoise.h>
+
+/// reconfigure
+#include <shape_matching/ShapeMatcherConfig.h>
+
+/// messages
+#include <auv_msgs/MatchedShape.h>
+
+typedef shape_matching::ShapeMatcherConfig _ShapeMatcherConfig;
+
+typedef auv_msgs::MatchedShape      _MatchedShape;
+
+typedef std::vector<cv::Point2i> _Contour;
+typedef std::vector<cv::Point2f> _Contour2f;
+typedef cv::Mat                  _Signature;
+
+#define DEBUG_SIZE(X, __String)						\
+  ROS_INFO("%s has rows: %d, cols: %d, channels: %d", __String, (X).rows, (X).cols, (X).channels() );
+
+struct ContourData
+{
+  _Contour2f contour_;   /// original contour in cartesian, for drawing later  (normalized)
+  _Signature signature_; /// radial histogram for EMD, see Rubner EMD paper
+  cv::Point2f mean_;
+  cv::Mat eigenvec_;
+  cv::Mat eigenval_;
+  double radius_; /// radius of bounding circle
+  double rotation_; /// rotation from XY in radians (right-handed)
+
+};
+
+/// Reusable buffers for analyzeContour(), so that signatures can be computed without allocating per contour
+struct SignatureScratch
+{
+  /// Points centered on the mean and rotated into the contour's principal frame, as 1xn rows
+  cv::Mat x_, y_;
+  cv::Mat magnitude_, angle_;
+  std::vector<double> bin_sums_;
+  std::vector<int> bin_counts_;
+  std::vector<int> order_;
+};
+
+/// A template that a contour matched, and how closely
+struct TemplateMatch
+{
+  TemplateIndex<ContourData>::Entry const * template_;
+  double emd_;
+};
+
+/// Which debug images someone wants this frame
+struct DebugImageRequest
+{
+  bool denoised_;
+  bool contours_;
+  bool matched_;
+};
+
+/// Everything that processing one color touches, so that colors can be processed concurrently. Reused between frames.
+struct ColorScratch
+{
+  cv::Mat denoised_;
+  cv::Mat region_contours_;
+  denoise::BinaryDenoiser denoiser_;
+  std::vector<_Contour> contours_;
+  std::vector<cv::Vec4i> hierarchy_;
+  /// Only drawn for the debug color, and only when someone is subscribed
+  cv::Mat contour_image_, match_image_;
+  std::vector<_MatchedShape> shapes_;
+  SignatureScratch signature_scratch_;
+  ContourData contour_data_;
+  std::vector<TemplateMatch> contour_matches_;
+  MatchCache<TemplateMatch> match_cache_;
+};
+
+typedef std::map<std::string, ContourData> _NamedContourData;
+typedef std::map<std::string, _Contour> _NamedContourMap;
+
+/// Hooks for timing the stages of ShapeMatcher::processColor(). Called from worker threads, so implementations must be thread safe.
+class ShapeMatcherProfiler
+{
+ public:
+  enum class Stage
+  {
+    /// Decoding a color's mask. Once per region.
+    DECODE,
+    /// Once per region
+    DENOISE,
+    /// findContours(). Once per region.
+    CONTOURS,
+    /// analyzeContour(). Once per contour.
+    ANALYZE,
+    /// Template pruning and EMDs. Once per contour that missed the match cache.
+    EMD,
+    COUNT
+  };
+
+  virtual ~ShapeMatcherProfiler(){}
+  
+  virtual void begin( Stage const & stage ) = 0;
+  virtual void end( Stage const & stage ) = 0;
+};
+
+/**
+ * The shape matcher's processing, without any ROS transport: templates and configuration go in, and matched shapes come out.
+ * ShapeMatcherNode wraps this with subscribers, publishers, and reconfigure, and the benchmark drives it directly.
+ */
+class ShapeMatcher
+{
+ private:
+  _NamedContourData templates_;
+  /// Skips full EMDs against templates that can't match
+  TemplateIndex<ContourData> template_index_;
+  _NamedContourMap template_contours_;
+  _ShapeMatcherConfig config_;
+  /// Colors are independent, so each one is processed as its own task
+  std::shared_ptr<uscauv::WorkerPool> worker_pool_;
+  std::map<std::string, ColorScratch> color_scratch_;
+  /// Colors processed by the last call to match(), in the order that their shapes were merged
+  std::vector<std::string> active_colors_;
+
+  /// Match cache bookkeeping. The generation changes whenever the templates do.
+  uint64_t frame_count_;
+  unsigned int template_generation_;
+  std::atomic<uint64_t> cache_lookups_;
+  std::atomic<uint64_t> cache_hits_;
+  
+  /// cost matrix for EMD algorithm
+  cv::Mat emd_cost_;
+  /// True if emd_cost_ is the circular distance between bins, which circular_emd can solve in closed form
+  bool emd_cost_circular_;
+
+  ShapeMatcherProfiler * profiler_;
+
+ public:
+  /** 
+   * @param threads Worker threads for processing colors concurrently. 0 uses every core.
+   */
+ ShapeMatcher( unsigned int const & threads = 0 ): config_( _ShapeMatcherConfig::__getDefault__() ), 
+    worker_pool_( std::make_shared<uscauv::WorkerPool>( threads ) ), frame_count_( 0 ), template_generation_( 0 ), 
+    cache_lookups_( 0 ), cache_hits_( 0 ), emd_cost_circular_( false ), profiler_( NULL )
+    {
+      
+    }
+
+  /** 
+   * Extract a template's contour. Its signature is generated on the next call to reconfigure().
+   * 
+   * @param image Grayscale template image with a single contour
+   * @return 0 on success, -1 if the image doesn't have exactly one contour
+   */
+  int addTemplate( std::string const & name, cv::Mat const & image )
+  {
+    ROS_INFO("Analyzing template contours [ %s ]...", name.c_str() );
+
+    /// findContours() modifies its input
+    cv::Mat template_image = image.clone();
+    std::vector<std::vector<cv::Point2i> > contours;
+    std::vector<cv::Vec4i> hierarchy;
+    cv::findContours( template_image, contours, hierarchy, 
+		      CV_RETR_TREE, CV_CHAIN_APPROX_NONE );
+	
+    if( contours.size() == 0)
+      {
+	ROS_WARN("No contours found. Skipping...");
+	return -1;
+      }
+    else if( contours.size() > 1)
+      {
+	ROS_WARN("Only single-contour templates are supported. Skipping...");
+	return -1;
+      }
+	
+    template_contours_[ name ] = contours[0];
+    ROS_INFO("Analysis successful.");
+    return 0;
+  }
+
+  /// Not owned. NULL disables profiling.
+  void setProfiler( ShapeMatcherProfiler * profiler )
+  {
+    profiler_ = profiler;
+  }
+
+  _ShapeMatcherConfig const & getConfig() const
+  {
+    return config_;
+  }
+
+  unsigned int getThreads() const
+  {
+    return worker_pool_->size();
+  }
+
+  /// Tracker regions have to be padded by this much so that denoising sees the same neighborhood it would in a full scan
+  int getRegionPadding() const
+  {
+    int kernel_size = config_.kernel_size;
+    kernel_size = (kernel_size % 2) ? kernel_size : kernel_size + 1;
+    return std::max( config_.struct_elem_size, kernel_size );
+  }
+
+  _NamedContourData const & getTemplates() const
+  {
+    return templates_;
+  }
+
+  TemplateIndex<ContourData> const & getTemplateIndex() const
+  {
+    return template_index_;
+  }
+
+  cv::Mat const & getEMDCost() const
+  {
+    return emd_cost_;
+  }
+
+  uint64_t getCacheLookups() const
+  {
+    return cache_lookups_;
+  }
+
+  uint64_t getCacheHits() const
+  {
+    return cache_hits_;
+  }
+
+  /// @return Buffers of a color processed by the last call to match(), including its debug images, or NULL if it wasn't processed
+  ColorScratch const * getColorScratch( std::string const & color_name ) const
+  {
+    if( std::find( active_colors_.begin(), active_colors_.end(), color_name ) == active_colors_.end() )
+      return NULL;
+    return &color_scratch_.find( color_name )->second;
+  }
+
+  /** 
+   * Match shapes in every color of a frame
+   * 
+   * @param regions Non-overlapping regions to process, clipped to the image. Ignored unless regions_only is set.
+   * @param regions_only If true, everything outside of regions is treated as empty
+   * @param debug_request Debug images to draw for the debug color
+   * @param shapes Output matches, sorted by color and then type
+   */
+  void match( uscauv::EncodedColorImage const & msg, std::vector<cv::Rect> const & regions, bool const & regions_only,
+	      DebugImageRequest const & debug_request, std::vector<_MatchedShape> & shapes )
+  {
+    ++frame_count_;
+    shapes.clear();
+
+    std::vector<cv::Rect> const full_frame( 1, cv::Rect( 0, 0, msg.cols(), msg.rows() ) );
+    std::vector<cv::Rect> const & process_regions = regions_only ? regions : full_frame;
+
+    /// Scratch entries are created up front, since the map can't be modified while tasks are using it
+    active_colors_.clear();
+    std::vector<uscauv::WorkerPool::TaskType> tasks;
+    for( std::string const & color_name : msg.getNames() )
+      {
+	/// Colors that don't appear anywhere can't produce contours, so don't bother decoding them. The debug color is always processed so its topics keep updating.
+	if( !msg.isPresent( color_name ) && color_name != config_.debug_color )
+	  continue;
+
+	ColorScratch & scratch = color_scratch_[ color_name ];
+	active_colors_.push_back( color_name );
+	tasks.push_back( [this, &msg, color_name, &process_regions, regions_only, &debug_request, &scratch]()
+			 {
+			   processColor( msg, color_name, process_regions, regions_only, debug_request, scratch );
+			 } );
+      }
+
+    worker_pool_->run( tasks );
+
+    /// Merge in a fixed order so that the output doesn't depend on which color finished first
+    for( std::string const & color_name : active_colors_ )
+      {
+	std::vector<_MatchedShape> const & color_shapes = color_scratch_[ color_name ].shapes_;
+	shapes.insert( shapes.end(), color_shapes.begin(), color_shapes.end() );
+      }
+    std::stable_sort( shapes.begin(), shapes.end(), []( _MatchedShape const & first, _MatchedShape const & second )
+		      {
+			return ( first.color != second.color ) ? first.color < second.color : first.type < second.type;
+		      } );
+  }
+
+ private:
+  typedef ShapeMatcherProfiler::Stage _Stage;
+  
+  void profileBegin( ShapeMatcherProfiler::Stage const & stage )
+  {
+    if( profiler_ )
+      profiler_->begin( stage );
+  }
+
+  void profileEnd( ShapeMatcherProfiler::Stage const & stage )
+  {
+    if( profiler_ )
+      profiler_->end( stage );
+  }
+
+  /** 
+   * Denoise one color, segment it into contours, and match every contour against every template. Runs on the worker pool
+   * concurrently with other colors, so it only writes to scratch.
+   * 
+   * @param regions Non-overlapping regions to process, clipped to the image
+   * @param regions_only If true, everything outside of regions is treated as empty
+   * @param debug_request Debug images to draw if this is the debug color
+   * @param scratch Buffers for this color. shapes_ is filled with the matches, unsorted.
+   */
+  void processColor( uscauv::EncodedColorImage const & msg, std::string const & color_name, 
+		     std::vector<cv::Rect> const & regions, bool const & regions_only, 
+		     DebugImageRequest const & debug_request, ColorScratch & scratch )
+  {
+    int kernel_size = config_.kernel_size;
+    kernel_size = (kernel_size % 2) ? kernel_size : kernel_size + 1;
+    bool const debug = ( color_name == config_.debug_color );
+    bool const draw_matches = debug && debug_request.matched_;
+    bool const draw_contours = draw_matches || ( debug && debug_request.contours_ );
+    /// Otherwise findContours() is free to scribble over the denoised mask
+    bool const keep_denoised = draw_contours || ( debug && debug_request.denoised_ );
+
+    denoise::Params const denoise_params = { config_.use_morph, config_.struct_elem_size, config_.use_blur, kernel_size,
+					     config_.use_floor, config_.floor_threshold, config_.use_otsu };
+    denoise::Engine const denoise_engine = denoise::Engine( config_.denoise_engine );
+
+    // ################################################################
+    // Apply a gaussian blur and threshold ############################
+    // ################################################################
+    /// Decoded straight into our own buffer, since the denoising below works in place. Everything outside of the regions stays empty.
+    cv::Mat & denoised = scratch.denoised_;
+    denoised.create( msg.rows(), msg.cols(), CV_8UC1 );
+    if( regions_only )
+      denoised.setTo( 0 );
+
+    std::vector<_Contour> & contours = scratch.contours_;
+    std::vector<cv::Vec4i> & hierarchy = scratch.hierarchy_;
+    contours.clear();
+    hierarchy.clear();
+    scratch.shapes_.clear();
+
+    for( cv::Rect const & region : regions )
+      {
+	cv::Mat region_denoised = denoised( region );
+	profileBegin( _Stage::DECODE );
+	msg.decodePlane( color_name, region_denoised, region );
+	profileEnd( _Stage::DECODE );
+
+	/// Decoded masks are binary, so the bit-parallel engine applies
+	profileBegin( _Stage::DENOISE );
+	if( denoise_engine == denoise::Engine::BINARY )
+	  scratch.denoiser_.apply( region_denoised, denoise_params );
+	else
+	  denoise::denoiseOpenCV( region_denoised, denoise_params );
+	profileEnd( _Stage::DENOISE );
+
+	/* cv::adaptiveThreshold( msg->image, denoised, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C,  */
+	/* 			   cv::THRESH_BINARY, kernel_size,  */
+	/* 			   getLatestConfig<_ShapeMatcherConfig>("image_proc").c ); */
+
+	// ################################################################
+	// Segment out contours ############################################
+	// ################################################################
+
+	/// findContours() modifies its input. Contours come back in full image coordinates.
+	profileBegin( _Stage::CONTOURS );
+	cv::Mat region_contours = region_denoised;
+	if( keep_denoised )
+	  {
+	    region_denoised.copyTo( scratch.region_contours_ );
+	    region_contours = scratch.region_contours_;
+	  }
+	std::vector<_Contour> new_contours;
+	std::vector<cv::Vec4i> new_hierarchy;
+
+	cv::findContours( region_contours, new_contours, new_hierarchy, 
+			  CV_RETR_TREE, CV_CHAIN_APPROX_NONE, region.tl() );
+
+	/// Hierarchy indices are relative to this region's contours
+	int const offset = contours.size();
+	for( cv::Vec4i & relation : new_hierarchy )
+	  for(int idx = 0; idx < 4; ++idx )
+	    if( relation[ idx ] != -1 )
+	      relation[ idx ] += offset;
+	    
+	contours.insert( contours.end(), new_contours.begin(), new_contours.end() );
+	hierarchy.insert( hierarchy.end(), new_hierarchy.begin(), new_hierarchy.end() );
+	profileEnd( _Stage::CONTOURS );
+      }
+
+    if( draw_contours )
+      {
+	cv::Mat & contour_image = scratch.contour_image_;
+	cv::cvtColor( denoised, contour_image, CV_GRAY2BGR );    
+
+	for(unsigned int idx = 0; idx < contours.size(); ++idx)
+	  {
+	    /// If the contour has a parent; it is a child
+	    if( hierarchy[idx][3] != -1 )
+	      {
+		cv::drawContours(contour_image, contours, idx, uscauv::CV_PINK_BGR,
+				 2, 8, hierarchy);
+	      }
+	    else
+	      cv::drawContours(contour_image, contours, idx, uscauv::CV_GREEN_BGR,
+			       2, 8, hierarchy);
+	  }
+
+	if( draw_matches )
+	  contour_image.copyTo( scratch.match_image_ );
+      }
+
+    // ################################################################
+    // Analyze contours and match shapes ##############################
+    // ################################################################
+
+    std::vector<TemplateIndex<ContourData>::Entry const *> candidates;
+
+    bool const use_cache = config_.use_match_cache;
+    if( use_cache )
+      scratch.match_cache_.beginFrame( frame_count_, template_generation_, config_.match_cache_frames );
+    else
+      scratch.match_cache_.clear();
+
+    for(unsigned int idx = 0; idx < contours.size(); ++idx )
+      {
+	/// Reused between contours so that its matrices keep their buffers
+	ContourData & result = scratch.contour_data_;
+	profileBegin( _Stage::ANALYZE );
+	int const analyzed = analyzeContour( contours[ idx ], result, config_.signature_size, scratch.signature_scratch_ );
+	profileEnd( _Stage::ANALYZE );
+	if( analyzed )
+	  continue;
+
+	/// A contour that looks the same as one from a recent frame matches the same templates
+	uint64_t cache_key = 0;
+	std::vector<TemplateMatch> const * contour_matches = NULL;
+	if( use_cache )
+	  {
+	    cache_key = MatchCache<TemplateMatch>::makeKey( result.mean_, cv::boundingRect( contours[ idx ] ), 
+							    cv::contourArea( contours[ idx ] ), result.signature_, 
+							    config_.match_cache_cell );
+	    contour_matches = scratch.match_cache_.find( cache_key );
+	    ++cache_lookups_;
+	    if( contour_matches )
+	      ++cache_hits_;
+	  }
+
+	if( !contour_matches )
+	  {
+	    profileBegin( _Stage::EMD );
+	    scratch.contour_matches_.clear();
+	    
+	    /// The lower bounds only hold for the circular cost
+	    template_index_.findCandidates( result.signature_, config_.emd_boundary, emd_cost_circular_, candidates );
+	
+	    for( TemplateIndex<ContourData>::Entry const * candidate : candidates )
+	      {
+		double const emd = computeEMD( result.signature_, candidate->data_->signature_ );
+		ROS_DEBUG("[ %s ] EMD: %f", candidate->name_.c_str(), emd );
+		
+		if( emd < config_.emd_boundary )
+		  scratch.contour_matches_.push_back( { candidate, emd } );
+	      }
+	    profileEnd( _Stage::EMD );
+	    
+	    if( use_cache )
+	      scratch.match_cache_.insert( cache_key, scratch.contour_matches_ );
+	    contour_matches = &scratch.contour_matches_;
+	  }
+	
+	for( TemplateMatch const & template_match : *contour_matches )
+	  {
+	    TemplateIndex<ContourData>::Entry const * candidate = template_match.template_;
+	    double const emd = template_match.emd_;
+	    
+	    /// Draw 
+	    ROS_DEBUG("Match detected.");
+	    if( draw_matches )
+	      {
+		result.contour_ = candidate->data_->contour_;
+		drawContour(scratch.match_image_, result, candidate->name_);
+	      }
+
+	    /// Populate match message
+	    _MatchedShape match;
+
+	    match.x = result.mean_.x;
+	    match.y = result.mean_.y;
+	    match.theta = result.rotation_;
+	    match.scale = result.radius_;
+		
+	    match.color = color_name;
+	    match.type = candidate->name_;
+
+	    /// Arbitrary measure of confidence. Covariance matrix is diagonal to reflect uncorrelatedness of parameters.
+	    match.covariance = { {emd, 0, 0, 0,
+				  0, emd, 0, 0,
+				  0, 0, emd, 0,
+				  0, 0, 0, emd} };
+
+	    scratch.shapes_.push_back( match );
+	  }
+	
+	/// finish analyzing, draw
+	/* cv::Point2f const & mean = result.mean_; */
+
+	/* ROS_INFO("Got mean %f, %f", mean.x, mean.y ); */
+	/* ROS_INFO("Got rotation %f.", result.rotation_ * 180 / M_PI); */
+	/* ROS_INFO("Got bounding circle radius: %f", result.radius_ ); */
+	/* cv::circle(match_image, mean, result.radius_, uscauv::CV_RED_BGR, 2); */
+	
+      }
+  }
+
+ public:
+  /// Apply a new configuration, and regenerate the template signatures for it
+  void reconfigure( _ShapeMatcherConfig const & config )
+  {
+    config_ = config;
+    
+    /// TODO: Cost type as a config argument
+    circularCostEuclidian( emd_cost_, config.signature_size );
+    emd_cost_circular_ = true;
+    /* ROS_INFO("Computed [ %dx%d ] circulant cost matrix.", emd_cost_.rows, emd_cost_.cols); */
+
+    for(_NamedContourMap::const_iterator contour_it = template_contours_.begin();
+	contour_it != template_contours_.end(); ++contour_it)
+      {
+	ROS_INFO("Generating template signature [ %s ]...", contour_it->first.c_str() );
+	ContourData result;
+	SignatureScratch signature_scratch;
+	/// Templates keep their contour for drawing matches
+	if(analyzeContour( contour_it->second, result, config.signature_size, signature_scratch, true ))
+	  ROS_WARN("Signaure generation failed.");
+	else
+	  {
+	    templates_[ contour_it->first ] = result;
+	    ROS_INFO("Signature generation success.");
+	  }
+      }
+
+    template_index_.build( templates_ );
+    /// Cached matches point into the old index
+    ++template_generation_;
+
+    return;
+  }
+
+  /// TODO: Fill the contour before doing mean/rotation ops
+  /** 
+   * Compute the position, orientation, size, and radial signature of a contour in a single pass over its points, plus
+   * one vectorized polar conversion. The signature is the mean radius of the points in each of nd equal angle bins,
+   * measured from the principal axis and normalized to sum to one.
+   * 
+   * @param result Output. Its matrices are reused if they are already the right size.
+   * @param nd Number of signature bins
+   * @param scratch Buffers reused between calls
+   * @param keep_contour If true, result.contour_ is set to the normalized points sorted by angle, for drawing later
+   * 
+   * @return 0 on success, -1 if the contour is too small or degenerate to have a signature
+   */
+  int analyzeContour( _Contour const & input, ContourData & result, int nd, SignatureScratch & scratch, bool keep_contour = false )
+  {
+    /// TODO: Figure out exactly causes issues when data is this small
+    if( input.size() <= 1 || nd <= 0 )
+      return -1;
+
+    int const points = input.size();
+
+    /// Mean and scatter matrix in closed form. Chain approximated contours have small integer coordinates, so this is exact.
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, sum_yy = 0;
+    for( cv::Point2i const & point : input )
+      {
+	sum_x += point.x;
+	sum_y += point.y;
+	sum_xx += double( point.x ) * point.x;
+	sum_xy += double( point.x ) * point.y;
+	sum_yy += double( point.y ) * point.y;
+      }
+    double const mean_x = sum_x / points, mean_y = sum_y / points;
+    double const cov_xx = sum_xx - sum_x * mean_x;
+    double const cov_xy = sum_xy - sum_x * mean_y;
+    double const cov_yy = sum_yy - sum_y * mean_y;
+
+    /// Eigendecomposition of the symmetric 2x2 scatter matrix, largest eigenvalue first
+    double const half_trace = ( cov_xx + cov_yy ) / 2;
+    double const discriminant = std::sqrt( std::max( 0.0, ( cov_xx - cov_yy ) * ( cov_xx - cov_yy ) / 4 + cov_xy * cov_xy ) );
+    double const eigenval1 = half_trace + discriminant, eigenval2 = half_trace - discriminant;
+
+    double ev1_x, ev1_y;
+    if( cov_xy != 0 )
+      {
+	ev1_x = eigenval1 - cov_yy;
+	ev1_y = cov_xy;
+      }
+    else
+      {
+	ev1_x = ( cov_xx >= cov_yy ) ? 1 : 0;
+	ev1_y = ( cov_xx >= cov_yy ) ? 0 : 1;
+      }
+    double const ev1_norm = std::sqrt( ev1_x * ev1_x + ev1_y * ev1_y );
+    ev1_x /= ev1_norm;
+    ev1_y /= ev1_norm;
+    
+    ROS_DEBUG("Got eigenvals: %f, %f", eigenval1, eigenval2 );
+    
+    /// atan is on the interval [-pi/2, pi/2]
+    float rotation = atan( ev1_y / ev1_x );
+    rotation = rotation - uscauv::PI_TWO;
+    if( rotation < -uscauv::PI_TWO )
+      rotation = uscauv::PI + rotation;
+    /// rotation is on [-pi/2, pi/2], with a rotation of zero indicating that biggest principal component is aligned with the y axis
+
+    /// Center at zero and rotate to zero, so that the angle of each point is measured from the principal axis
+    double const cos_rotation = std::cos( rotation ), sin_rotation = std::sin( rotation );
+    scratch.x_.create( 1, points, CV_32FC1 );
+    scratch.y_.create( 1, points, CV_32FC1 );
+    float * x = scratch.x_.ptr<float>(0);
+    float * y = scratch.y_.ptr<float>(0);
+    for(int idx = 0; idx < points; ++idx )
+      {
+	double const dx = input[ idx ].x - mean_x, dy = input[ idx ].y - mean_y;
+	x[ idx ] = dx * cos_rotation + dy * sin_rotation;
+	y[ idx ] = dy * cos_rotation - dx * sin_rotation;
+      }
+
+    /// Vectorized inside OpenCV. Angles are in degrees on [0, 360).
+    cv::cartToPolar( scratch.x_, scratch.y_, scratch.magnitude_, scratch.angle_, true );
+    float const * radius = scratch.magnitude_.ptr<float>(0);
+    float const * angle = scratch.angle_.ptr<float>(0);
+
+    /// Bin by angle directly, no sorting needed
+    scratch.bin_sums_.assign( nd, 0.0 );
+    scratch.bin_counts_.assign( nd, 0 );
+    double max_radius = 0;
+    float const bins_per_degree = nd / 360.0f;
+    for(int idx = 0; idx < points; ++idx )
+      {
+	int bin = angle[ idx ] * bins_per_degree;
+	bin = ( bin >= nd ) ? bin - nd : bin;
+	
+	scratch.bin_sums_[ bin ] += radius[ idx ];
+	++scratch.bin_counts_[ bin ];
+	max_radius = std::max( max_radius, double( radius[ idx ] ) );
+      }
+
+    if( max_radius <= 0 )
+      return -1;
+
+    /// Mean radius per bin. Normalizing the radius to the bounding circle cancels out once the signature is turned into a pdf.
+    result.signature_.create( nd, 1, CV_32FC1 );
+    float * signature = result.signature_.ptr<float>(0);
+    double signature_sum = 0;
+    for(int bin = 0; bin < nd; ++bin )
+      {
+	double const bin_mean = scratch.bin_counts_[ bin ] ? scratch.bin_sums_[ bin ] / scratch.bin_counts_[ bin ] : 0;
+	signature[ bin ] = bin_mean;
+	signature_sum += bin_mean;
+      }
+    
+    /// Turn signature into pdf
+    for(int bin = 0; bin < nd; ++bin )
+      signature[ bin ] /= signature_sum;
+
+    result.mean_      = cv::Point2f( mean_x, mean_y );
+    result.eigenval_.create( 2, 1, CV_32FC1 );
+    result.eigenval_.at<float>( 0 ) = eigenval1;
+    result.eigenval_.at<float>( 1 ) = eigenval2;
+    /// Eigenvectors in rows, like cv::eigen
+    result.eigenvec_.create( 2, 2, CV_32FC1 );
+    float * eigenvec = result.eigenvec_.ptr<float>(0);
+    eigenvec[0] = ev1_x;  eigenvec[1] = ev1_y;
+    eigenvec[2] = -ev1_y; eigenvec[3] = ev1_x;
+    result.rotation_  = rotation;
+    result.radius_    = max_radius;
+
+    /// Normalized cartesian points in order of angle, so that they can be drawn as a polygon
+    result.contour_.clear();
+    if( keep_contour )
+      {
+	scratch.order_.resize( points );
+	for(int idx = 0; idx < points; ++idx )
+	  scratch.order_[ idx ] = idx;
+	std::sort( scratch.order_.begin(), scratch.order_.end(), [angle]( int first, int second ){ return angle[ first ] < angle[ second ]; } );
+
+	result.contour_.reserve( points );
+	for( int const idx : scratch.order_ )
+	  result.contour_.push_back( cv::Point2f( x[ idx ] / max_radius, y[ idx ] / max_radius ) );
+      }
+
+    return 0;
+  }
+
+  /** 
+   * EMD between two signatures under emd_cost_. Uses the closed form circular EMD when the cost allows it,
+   * and cv::EMD's general transportation solver otherwise.
+   */
+  double computeEMD( _Signature const & signature1, _Signature const & signature2 )
+  {
+    double emd;
+    if( config_.fast_emd && emd_cost_circular_ && !circular_emd::compute( signature1, signature2, emd ) )
+      return emd;
+    
+    /// calculate EMD using our custom cost matrix
+    return cv::EMD( signature1, signature2, CV_DIST_USER, emd_cost_ );
+  }
+
+ private:
+  /// I copied and pasted a bunch of code from the analyzeContours function because I'm lazy!
+  void drawContour(cv::Mat & img, ContourData const & contour_data, std::string const & name = "")
+  {
+    int const pc_size = 10;
+    int const thickness = 1.5;
+
+    int const font = cv::FONT_HERSHEY_SIMPLEX;
+    double const font_scale = 0.5;
+    int const font_thickness = 1.5;
+
+    cv::Point2i mean( contour_data.mean_.x, contour_data.mean_.y); 
+    
+    _Contour output_contour;
+    std::vector<_Contour> contours;
+    cv::Mat contour; cv::Mat(contour_data.contour_).convertTo(contour, CV_32F);
+    contour = contour.reshape(1, 0); 
+
+    for(int idx = 0; idx < contour.rows; ++idx)
+      {
+	float* row = contour.ptr<float>(idx);
+	float theta = cv::fastAtan2( row[1], row[0] );
+	/// rotate to zero
+	theta += (contour_data.rotation_*180/M_PI); 
+	/// Make sure that theta stays in the range [0, 2pi]
+	theta = 
+	  ((theta < 0 ) ? 360 + theta: 
+	   (theta > 360 ) ? -360 + theta: 
+	   theta) * M_PI / 180;
+	float rad = sqrt(pow(row[0], 2) + pow(row[1], 2)) * contour_data.radius_;
+	row[0] = theta; row[1] = rad;
+      }
+    /// TODO: Combine these loops
+    for(int idx = 0; idx < contour.rows; ++idx)
+      {
+	float* row = contour.ptr<float>(idx);
+	cv::Point2i mp = cv::Point2i( row[1]*cos(row[0]), row[1]*sin(row[0]))+mean;
+	output_contour.push_back(mp);
+      }    
+    contours.push_back(output_contour);
+
+    /// TODO: fix this
+    /// draw the contour
+    cv::drawContours(img, contours, 0, uscauv::CV_USCCARDINAL_BGR, 2);
+    /// draw principal components
+    const float* evec = contour_data.eigenvec_.ptr<float>(0);
+    cv::Point2i e1( evec[0]*pc_size, evec[1]*pc_size), 
+      e2( evec[2]*pc_size, evec[3]*pc_size);
+
+    cv::line(img, mean - e1, mean + e1,
+	     uscauv::CV_USCCARDINAL_BGR, thickness );
+    cv::line(img, mean - e2, mean + e2,
+	     uscauv::CV_USCCARDINAL_BGR, thickness );
+
+    /// draw text
+    if( name != "" )
+      cv::putText( img, name, mean, font, font_scale, 
+		   uscauv::CV_USCGOLD_BGR, font_thickness );
+    
+   }
+
+  /**
+   * Generate a cost matrix for the cv::EMD function. Our signatures
+   * live in polar coordinates and thus have a circular distance function.
+   */
+
+  int algebraic_mod(int a, int b){ return ((a%b)+b)%b; }
+  
+  void circularCostEuclidian( cv::Mat & cost, int nd )
+  {
+    cost.create( nd, nd, CV_32FC1 );
+
+    for(int idy = 0; idy < nd; ++idy )
+      {
+	float * cost_row = cost.ptr<float>( idy );
+	for(int idx = 0; idx < nd; ++idx )
+	  {
+	    cost_row[ idx ] = std::min( algebraic_mod(idx - idy, nd), 
+					algebraic_mod(idy - idx, nd) );
+	  }
+      }
+  }
+
+  void circularCostExp( cv::Mat & cost, int nd, float c = 1 )
+  {
+    circularCostEuclidian( cost, nd );
+    
+    float* cost_ptr = cost.ptr<float>(0);
+    for(int idx= 0; idx < nd*nd;  ++idx )
+      {
+	cost_ptr[idx] = exp( -cost_ptr[idx]*c);
+      }
+  }
+  
+
+};
+
+#endif // USCAUV_SHAPEMATCHING_MATCHER
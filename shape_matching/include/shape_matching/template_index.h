@@ -0,0 +1,153 @@
+/***************************************************************************
+ *  include/shape_matching/template_index.h
+ *  --------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+
+#ifndef USCAUV_SHAPEMATCHING_TEMPLATEINDEX
+#define USCAUV_SHAPEMATCHING_TEMPLATEINDEX
+
+/// shape_matching
+#include <shape_matching/circular_emd.h>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// cpp11
+#include <atomic>
+#include <string>
+#include <vector>
+
+/**
+ * Lets the shape matcher skip the full EMD for templates that can't possibly match. Each template's
+ * low frequency Fourier modes are precomputed, and a contour is only compared in full against the templates
+ * whose circular EMD lower bound is below the match boundary. The bound never overestimates, so the
+ * matches are exactly the same as comparing against every template.
+ *
+ * Counters are atomic so that colors processed concurrently can share one index.
+ */
+template<class __TemplateData>
+class TemplateIndex
+{
+ public:
+  /// EMD solvers work in single precision, so leave a little room before trusting a bound
+  static constexpr double BOUND_SLACK = 1e-5;
+  
+  struct Entry
+  {
+    std::string name_;
+    __TemplateData const * data_;
+    circular_emd::Modes modes_;
+    /// False if the bound doesn't apply to this template, in which case it is always compared in full
+    bool bounded_;
+  };
+  
+ private:
+  std::vector<Entry> entries_;
+  
+  std::atomic<uint64_t> compared_;
+  std::atomic<uint64_t> pruned_;
+  
+ public:
+ TemplateIndex(): compared_( 0 ), pruned_( 0 ) {}
+
+  /** 
+   * @param templates Map from template name to data with a signature_ member. Must outlive the index.
+   */
+  template<class __TemplateMap>
+    void build( __TemplateMap const & templates )
+  {
+    entries_.clear();
+    for( typename __TemplateMap::value_type const & element : templates )
+      {
+	Entry entry;
+	entry.name_ = element.first;
+	entry.data_ = &element.second;
+	entry.bounded_ = !circular_emd::computeModes( element.second.signature_, entry.modes_ );
+	entries_.push_back( entry );
+      }
+  }
+
+  std::vector<Entry> const & getEntries() const
+  {
+    return entries_;
+  }
+
+  /** 
+   * Find the templates that might be within boundary of signature
+   * 
+   * @param signature Signature of the contour being matched
+   * @param boundary Largest EMD that counts as a match
+   * @param use_bounds If false, every template is a candidate. The bounds only hold for the circular cost.
+   * @param candidates Output templates that still need a full EMD, in the same order as the templates map
+   */
+  void findCandidates( cv::Mat const & signature, double const & boundary, bool const & use_bounds,
+		       std::vector<Entry const *> & candidates )
+  {
+    candidates.clear();
+    
+    circular_emd::Modes modes;
+    bool const bounded = use_bounds && !circular_emd::computeModes( signature, modes );
+    
+    for( Entry const & entry : entries_ )
+      {
+	if( bounded && entry.bounded_ && circular_emd::lowerBound( modes, entry.modes_ ) >= boundary + BOUND_SLACK )
+	  continue;
+	candidates.push_back( &entry );
+      }
+
+    compared_ += entries_.size();
+    pruned_ += entries_.size() - candidates.size();
+  }
+
+  /// Number of (contour, template) pairs seen since the last resetCounters()
+  uint64_t getCompared() const
+  {
+    return compared_;
+  }
+
+  /// Number of those pairs that were rejected without a full EMD
+  uint64_t getPruned() const
+  {
+    return pruned_;
+  }
+
+  void resetCounters()
+  {
+    compared_ = 0;
+    pruned_ = 0;
+  }
+};
+
+#endif // USCAUV_SHAPEMATCHING_TEMPLATEINDEX
@@ -0,0 +1,183 @@
+/***************************************************************************
+ *  src/denoise_benchmark.cpp
+ *  --------------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <iostream>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <shape_matching/denoise.h>
+
+/// C++11
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+const std::string keys =
+  "{    h| help          |false | Print this message.                                       }"
+  "{    i| input         |false | Grayscale mask to denoise. Thresholded at 128. Synthetic if not given. }"
+  "{    W| width         |640   | Width of the synthetic mask                               }"
+  "{    H| height        |480   | Height of the synthetic mask                              }"
+  "{    n| iterations    |200   | Frames to denoise with each engine                        }"
+  "{    s| struct        |5     | Structuring element size                                  }"
+  "{    k| kernel        |31    | Blur kernel size. Made odd like in the shape matcher.     }"
+  "{    f| floor         |30    | Floor threshold                                           }"
+  "{    m| no-morph      |false | Disable the opening                                       }"
+  "{    b| no-blur       |false | Disable the blur                                          }"
+  "{    F| use-floor     |false | Enable the floor threshold                                }"
+  "{    o| no-otsu       |false | Disable the Otsu threshold                                }"
+  "{    S| seed          |0     | Seed for the synthetic mask                               }"
+  "{    w| write         |false | Write both outputs to denoise_opencv.png and denoise_binary.png }"
+  ;
+
+/// Some blobs and some speckle, roughly what comes out of the color classifier
+cv::Mat makeSyntheticMask( int const & width, int const & height, unsigned int const & seed )
+{
+  std::mt19937 generator( seed );
+  std::uniform_real_distribution<double> unit( 0, 1 );
+  
+  cv::Mat mask = cv::Mat::zeros( height, width, CV_8UC1 );
+
+  for( int blob = 0; blob < 6; ++blob )
+    {
+      cv::Point const center( unit( generator ) * width, unit( generator ) * height );
+      cv::Size const axes( 10 + unit( generator ) * width / 8, 10 + unit( generator ) * height / 8 );
+      cv::ellipse( mask, center, axes, unit( generator ) * 180, 0, 360, cv::Scalar( 255 ), -1 );
+    }
+
+  /// Salt and pepper, 2% of pixels flipped
+  for( int idx = 0; idx < width * height / 50; ++idx )
+    {
+      uchar & pixel = mask.at<uchar>( unit( generator ) * height, unit( generator ) * width );
+      pixel = 255 - pixel;
+    }
+  
+  return mask;
+}
+
+/** 
+ * Denoise copies of the input with one engine.
+ * 
+ * @param output Result of the last iteration
+ * @return Mean milliseconds per frame, not counting the copy
+ */
+template<class __Denoise>
+double benchmark( cv::Mat const & input, int const & iterations, cv::Mat & output, __Denoise denoise )
+{
+  std::chrono::duration<double, std::milli> elapsed( 0 );
+  
+  for( int iteration = 0; iteration < iterations; ++iteration )
+    {
+      input.copyTo( output );
+      
+      std::chrono::high_resolution_clock::time_point const start = std::chrono::high_resolution_clock::now();
+      denoise( output );
+      elapsed += std::chrono::high_resolution_clock::now() - start;
+    }
+  
+  return elapsed.count() / std::max( iterations, 1 );
+}
+
+int main(int argc, const char ** argv)
+{
+  std::cout << "USC AUV shape matcher denoise benchmark" << std::endl;
+  
+  cv::CommandLineParser parser( argc, argv, keys.c_str() );
+
+  if ( parser.get<bool>("help") )
+    {
+      std::cout << "usage: " << argv[0]  << " [--input=\"mask.png\"]" << std::endl;
+      parser.printParams();
+      return 0;
+    }
+
+  std::string const input_path = parser.get<std::string>("input");
+  int const iterations         = parser.get<int>("iterations");
+  int kernel_size              = parser.get<int>("kernel");
+  kernel_size = (kernel_size % 2) ? kernel_size : kernel_size + 1;
+
+  denoise::Params const params = { !parser.get<bool>("no-morph"), parser.get<int>("struct"), 
+				   !parser.get<bool>("no-blur"), kernel_size, 
+				   parser.get<bool>("use-floor"), parser.get<double>("floor"),
+				   !parser.get<bool>("no-otsu") };
+
+  cv::Mat input;
+  if( input_path != "false" )
+    {
+      input = cv::imread( input_path, 0 );
+      if( input.empty() )
+	{
+	  std::cerr << "Failed to load " << input_path << std::endl;
+	  return 1;
+	}
+      cv::threshold( input, input, 127, 255, cv::THRESH_BINARY );
+    }
+  else
+    input = makeSyntheticMask( parser.get<int>("width"), parser.get<int>("height"), parser.get<int>("seed") );
+
+  std::cout << "Mask: " << input.cols << "x" << input.rows << ", " << iterations << " iterations" << std::endl
+	    << "Stages: morph " << params.use_morph_ << " (" << params.struct_elem_size_ << "), blur " << params.use_blur_
+	    << " (" << params.kernel_size_ << "), floor " << params.use_floor_ << " (" << params.floor_threshold_ << "), otsu "
+	    << params.use_otsu_ << std::endl;
+
+  cv::Mat opencv_output, binary_output;
+  denoise::BinaryDenoiser denoiser;
+
+  double const opencv_ms = benchmark( input, iterations, opencv_output, [&params]( cv::Mat & mask )
+				      { denoise::denoiseOpenCV( mask, params ); } );
+  double const binary_ms = benchmark( input, iterations, binary_output, [&params, &denoiser]( cv::Mat & mask )
+				      { denoiser.apply( mask, params ); } );
+
+  /// The opening is exact, but the box blur only approximates the Gaussian, so edges can move a little when blurring
+  cv::Mat difference;
+  cv::compare( opencv_output, binary_output, difference, cv::CMP_NE );
+  double const agreement = 1. - double( cv::countNonZero( difference ) ) / input.total();
+
+  std::cout << std::fixed << std::setprecision(3)
+	    << "OpenCV: " << opencv_ms << " ms/frame" << std::endl
+	    << "Binary: " << binary_ms << " ms/frame (" << opencv_ms / binary_ms << "x)" << std::endl
+	    << "Agreement: " << 100. * agreement << "% of pixels" << std::endl;
+
+  if( parser.get<bool>("write") )
+    {
+      cv::imwrite( "denoise_opencv.png", opencv_output );
+      cv::imwrite( "denoise_binary.png", binary_output );
+    }
+  
+  return 0;
+}
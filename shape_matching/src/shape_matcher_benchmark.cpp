@@ -0,0 +1,649 @@
+/***************************************************************************
+ *  src/shape_matcher_benchmark.cpp
+ *  --------------------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <iostream>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <shape_matching/matcher.h>
+
+/// Boost filesystem
+#include <boost/filesystem.hpp>
+
+/// C++11
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <random>
+
+namespace _FileSys = boost::filesystem;
+
+typedef std::chrono::high_resolution_clock _Clock;
+
+/// Defaults follow params/image_proc.yaml, which is what the vision pipeline launches the shape matcher with
+const std::string keys =
+  "{    h| help          |false | Print this message.                                       }"
+  "{    t| templates     |false | Directory of template images, like the ones uploaded to model/shapes. Synthetic if not given. }"
+  "{    n| frames        |100   | Frames to match                                           }"
+  "{    w| warmup        |5     | Frames to match before measuring                          }"
+  "{    W| width         |640   | Frame width                                               }"
+  "{    H| height        |480   | Frame height                                              }"
+  "{    c| colors        |3     | Colors per frame                                          }"
+  "{    b| blobs         |4     | Blobs per color                                           }"
+  "{    r| min-radius    |15    | Smallest blob radius in pixels                            }"
+  "{    R| max-radius    |60    | Largest blob radius in pixels                             }"
+  "{    a| rotation      |180   | Blobs start rotated by up to this many degrees either way }"
+  "{    d| drift         |1     | Pixels that each blob moves per frame                     }"
+  "{    s| spin          |0     | Degrees that each blob rotates per frame                  }"
+  "{    N| noise         |0.01  | Fraction of pixels flipped in each color                  }"
+  "{    S| seed          |0     | Seed for the synthetic frames                             }"
+  "{    T| threads       |1     | Worker threads. 0 uses every core. Stage times are summed over threads. }"
+  "{    k| kernel        |30    | Blur kernel size                                          }"
+  "{    e| struct        |5     | Structuring element size                                  }"
+  "{    g| signature     |30    | Signature bins                                            }"
+  "{    B| boundary      |0.4   | Largest EMD that counts as a match                        }"
+  "{    D| denoise       |0     | Denoise engine. 0 is OpenCV, 1 is Binary.                 }"
+  "{    x| exact-emd     |false | Use cv::EMD instead of the closed form circular EMD       }"
+  "{    C| cache         |false | Enable the match cache                                    }"
+  "{    A| agreement     |false | Compare the closed form EMD to cv::EMD on every contour and template }"
+  ;
+
+// ################################################################
+// Allocation counting ############################################
+// ################################################################
+
+/**
+ * Heap allocations, by the whole process and by the current thread. malloc() and friends are replaced for the whole
+ * process, so this counts operator new (which calls malloc()), cv::fastMalloc() (which backs every cv::Mat), and
+ * plain malloc() calls inside OpenCV and the C++ runtime alike. Forwards to glibc's implementations.
+ */
+std::atomic<uint64_t> total_allocations( 0 );
+thread_local uint64_t thread_allocations = 0;
+
+extern "C"
+{
+  void * __libc_malloc( size_t size );
+  void * __libc_calloc( size_t count, size_t size );
+  void * __libc_realloc( void * memory, size_t size );
+  void * __libc_memalign( size_t alignment, size_t size );
+  void __libc_free( void * memory );
+
+  void * malloc( size_t size )
+  {
+    ++total_allocations;
+    ++thread_allocations;
+    return __libc_malloc( size );
+  }
+
+  void * calloc( size_t count, size_t size )
+  {
+    ++total_allocations;
+    ++thread_allocations;
+    return __libc_calloc( count, size );
+  }
+
+  /// Only counted when it has to allocate
+  void * realloc( void * memory, size_t size )
+  {
+    if( !memory )
+      {
+	++total_allocations;
+	++thread_allocations;
+      }
+    return __libc_realloc( memory, size );
+  }
+
+  void * memalign( size_t alignment, size_t size )
+  {
+    ++total_allocations;
+    ++thread_allocations;
+    return __libc_memalign( alignment, size );
+  }
+
+  void * aligned_alloc( size_t alignment, size_t size )
+  {
+    return memalign( alignment, size );
+  }
+
+  int posix_memalign( void ** memory, size_t alignment, size_t size )
+  {
+    if( alignment % sizeof( void * ) || ( alignment & ( alignment - 1 ) ) )
+      return EINVAL;
+    
+    void * const aligned = memalign( alignment, size );
+    if( !aligned && size )
+      return ENOMEM;
+    
+    *memory = aligned;
+    return 0;
+  }
+
+  void free( void * memory )
+  {
+    __libc_free( memory );
+  }
+}
+
+/// Time and allocations for each stage, summed over every thread
+class StageProfiler: public ShapeMatcherProfiler
+{
+ public:
+  static int const STAGES = int( Stage::COUNT );
+  
+ private:
+  struct ThreadState
+  {
+    _Clock::time_point start_[ STAGES ];
+    uint64_t allocations_[ STAGES ];
+  };
+
+  std::atomic<uint64_t> nanoseconds_[ STAGES ];
+  std::atomic<uint64_t> allocations_[ STAGES ];
+  std::atomic<uint64_t> calls_[ STAGES ];
+
+  static ThreadState & threadState()
+  {
+    static thread_local ThreadState state;
+    return state;
+  }
+
+ public:
+  StageProfiler()
+    {
+      reset();
+    }
+  
+  void reset()
+  {
+    for(int stage = 0; stage < STAGES; ++stage )
+      {
+	nanoseconds_[ stage ] = 0;
+	allocations_[ stage ] = 0;
+	calls_[ stage ] = 0;
+      }
+  }
+
+  void begin( Stage const & stage )
+  {
+    ThreadState & state = threadState();
+    state.allocations_[ int( stage ) ] = thread_allocations;
+    state.start_[ int( stage ) ] = _Clock::now();
+  }
+
+  void end( Stage const & stage )
+  {
+    _Clock::time_point const now = _Clock::now();
+    ThreadState & state = threadState();
+    
+    nanoseconds_[ int( stage ) ] += std::chrono::duration_cast<std::chrono::nanoseconds>( now - state.start_[ int( stage ) ] ).count();
+    allocations_[ int( stage ) ] += thread_allocations - state.allocations_[ int( stage ) ];
+    ++calls_[ int( stage ) ];
+  }
+
+  double getMilliseconds( int const & stage ) const { return nanoseconds_[ stage ] / 1e6; }
+  uint64_t getAllocations( int const & stage ) const { return allocations_[ stage ]; }
+  uint64_t getCalls( int const & stage ) const { return calls_[ stage ]; }
+};
+
+char const * const STAGE_NAMES[ StageProfiler::STAGES ] = { "decode", "denoise", "contours", "analyzeContour", "EMD" };
+
+// ################################################################
+// Synthetic frames ###############################################
+// ################################################################
+
+/// A template drawn somewhere in the frame. Moves a little every frame so that consecutive frames look like video.
+struct Blob
+{
+  int color_;
+  int shape_;
+  cv::Point2f position_;
+  cv::Point2f velocity_;
+  float angle_;
+  float spin_;
+  float radius_;
+};
+
+/// Stand-ins for model/shapes, so that the benchmark runs without the shape model
+void makeSyntheticTemplates( std::map<std::string, cv::Mat> & templates )
+{
+  int const size = 200;
+  cv::Point const center( size / 2, size / 2 );
+  
+  cv::Mat circle = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::circle( circle, center, 70, cv::Scalar( 255 ), -1 );
+  templates[ "circle" ] = circle;
+
+  cv::Mat bar = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::rectangle( bar, cv::Point( 30, 75 ), cv::Point( 170, 125 ), cv::Scalar( 255 ), -1 );
+  templates[ "bar" ] = bar;
+
+  cv::Mat triangle = cv::Mat::zeros( size, size, CV_8UC1 );
+  std::vector<cv::Point> const triangle_points = { cv::Point( 100, 25 ), cv::Point( 170, 160 ), cv::Point( 30, 160 ) };
+  cv::fillConvexPoly( triangle, triangle_points, cv::Scalar( 255 ) );
+  templates[ "triangle" ] = triangle;
+
+  cv::Mat cross = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::rectangle( cross, cv::Point( 85, 30 ), cv::Point( 115, 170 ), cv::Scalar( 255 ), -1 );
+  cv::rectangle( cross, cv::Point( 30, 85 ), cv::Point( 170, 115 ), cv::Scalar( 255 ), -1 );
+  templates[ "cross" ] = cross;
+}
+
+/// @return 0 on success, -1 if the directory can't be read or has no images
+int loadTemplates( std::string const & path, std::map<std::string, cv::Mat> & templates )
+{
+  _FileSys::path const template_dir( path );
+  if ( !_FileSys::exists( template_dir ) || !_FileSys::is_directory( template_dir ) )
+    {
+      std::cerr << "Template directory [ " << path << " ] does not exist." << std::endl;
+      return -1;
+    }
+
+  for( _FileSys::directory_iterator path_it( template_dir ); path_it != _FileSys::directory_iterator(); ++path_it )
+    {
+      if( !_FileSys::is_regular_file( *path_it ) )
+	continue;
+      
+      cv::Mat const image = cv::imread( path_it->path().string(), CV_LOAD_IMAGE_GRAYSCALE );
+      if( image.empty() )
+	continue;
+      
+      templates[ path_it->path().stem().string() ] = image;
+    }
+
+  return templates.empty() ? -1 : 0;
+}
+
+/** 
+ * @param image Template image with a single contour
+ * @param shape Output contour, centered on its mean and scaled so that its farthest point is at radius 1
+ */
+void normalizeTemplate( cv::Mat const & image, _Contour2f & shape )
+{
+  cv::Mat contour_image = image.clone();
+  std::vector<_Contour> contours;
+  cv::findContours( contour_image, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+
+  shape.clear();
+  if( contours.empty() )
+    return;
+  
+  cv::Moments const moments = cv::moments( contours.front() );
+  cv::Point2f const center( moments.m10 / moments.m00, moments.m01 / moments.m00 );
+
+  float max_radius = 0;
+  for( cv::Point2i const & point : contours.front() )
+    max_radius = std::max( max_radius, float( cv::norm( cv::Point2f( point ) - center ) ) );
+  
+  for( cv::Point2i const & point : contours.front() )
+    shape.push_back( ( cv::Point2f( point ) - center ) * ( 1.f / max_radius ) );
+}
+
+/// Draw every blob into its color's mask, flip noise, and encode the masks like the color classifier does
+uscauv::EncodedColorImageConstPtr renderFrame( std::vector<Blob> const & blobs, std::vector<_Contour2f> const & shapes,
+					       std::vector<std::string> const & colors, cv::Size const & size, 
+					       double const & noise, std::mt19937 & generator )
+{
+  std::uniform_int_distribution<int> random_x( 0, size.width - 1 ), random_y( 0, size.height - 1 );
+  int const flips = noise * size.area();
+  
+  uscauv::ColorEncoder encoder;
+  for(unsigned int color = 0; color < colors.size(); ++color )
+    {
+      cv::Mat mask = cv::Mat::zeros( size, CV_8UC1 );
+      
+      for( Blob const & blob : blobs )
+	{
+	  if( blob.color_ != int( color ) )
+	    continue;
+
+	  float const cos_angle = std::cos( blob.angle_ ), sin_angle = std::sin( blob.angle_ );
+	  std::vector<std::vector<cv::Point> > polygon( 1 );
+	  for( cv::Point2f const & point : shapes[ blob.shape_ ] )
+	    polygon.front().push_back( cv::Point( blob.position_.x + blob.radius_ * ( point.x * cos_angle - point.y * sin_angle ),
+						  blob.position_.y + blob.radius_ * ( point.x * sin_angle + point.y * cos_angle ) ) );
+	  cv::fillPoly( mask, polygon, cv::Scalar( 255 ) );
+	}
+
+      for(int flip = 0; flip < flips; ++flip )
+	{
+	  uchar & pixel = mask.at<uchar>( random_y( generator ), random_x( generator ) );
+	  pixel = 255 - pixel;
+	}
+      
+      encoder.addImage( mask, colors[ color ] );
+    }
+
+  cv_bridge::CvImageConstPtr const encoded = boost::make_shared<cv_bridge::CvImage>( std_msgs::Header(), encoder.getImageType(), 
+										       encoder.getImage() );
+  return std::make_shared<uscauv::EncodedColorImage>( encoded, encoder.getNames() );
+}
+
+/// Move every blob by its velocity, bouncing off of the edges of the frame
+void moveBlobs( std::vector<Blob> & blobs, cv::Size const & size )
+{
+  for( Blob & blob : blobs )
+    {
+      blob.position_ += blob.velocity_;
+      blob.angle_ += blob.spin_;
+      
+      if( blob.position_.x < 0 || blob.position_.x >= size.width )
+	blob.velocity_.x = -blob.velocity_.x;
+      if( blob.position_.y < 0 || blob.position_.y >= size.height )
+	blob.velocity_.y = -blob.velocity_.y;
+    }
+}
+
+// ################################################################
+// EMD agreement ##################################################
+// ################################################################
+
+/// How the closed form circular EMD compares to cv::EMD under the same circular cost
+struct EMDAgreement
+{
+  uint64_t pairs_;
+  /// Pairs that the closed form couldn't handle, so the matcher would fall back to cv::EMD anyway
+  uint64_t fallbacks_;
+  /// Pairs that land on opposite sides of the match boundary
+  uint64_t disagreements_;
+  double max_error_;
+  double total_error_;
+};
+
+/// Compare both EMDs for every contour of every color in the last frame that the matcher processed
+void checkAgreement( ShapeMatcher & matcher, std::vector<std::string> const & colors, EMDAgreement & agreement )
+{
+  _ShapeMatcherConfig const & config = matcher.getConfig();
+  ContourData data;
+  SignatureScratch scratch;
+  
+  for( std::string const & color : colors )
+    {
+      ColorScratch const * color_scratch = matcher.getColorScratch( color );
+      if( !color_scratch )
+	continue;
+
+      for( _Contour const & contour : color_scratch->contours_ )
+	{
+	  if( matcher.analyzeContour( contour, data, config.signature_size, scratch ) )
+	    continue;
+
+	  for( _NamedContourData::value_type const & element : matcher.getTemplates() )
+	    {
+	      _Signature const & template_signature = element.second.signature_;
+	      double const exact = cv::EMD( data.signature_, template_signature, CV_DIST_USER, matcher.getEMDCost() );
+	      ++agreement.pairs_;
+	      
+	      double fast;
+	      if( circular_emd::compute( data.signature_, template_signature, fast ) )
+		{
+		  ++agreement.fallbacks_;
+		  continue;
+		}
+
+	      double const error = std::fabs( fast - exact );
+	      agreement.max_error_ = std::max( agreement.max_error_, error );
+	      agreement.total_error_ += error;
+	      if( ( fast < config.emd_boundary ) != ( exact < config.emd_boundary ) )
+		++agreement.disagreements_;
+	    }
+	}
+    }
+}
+
+int main(int argc, const char ** argv)
+{
+  std::cout << "USC AUV shape matcher benchmark" << std::endl;
+  
+  cv::CommandLineParser parser( argc, argv, keys.c_str() );
+
+  if ( parser.get<bool>("help") )
+    {
+      std::cout << "usage: " << argv[0]  << " [--templates=\"template_dir\"]" << std::endl;
+      parser.printParams();
+      return 0;
+    }
+
+  std::string const template_path = parser.get<std::string>("templates");
+  int const frames                = std::max( parser.get<int>("frames"), 1 );
+  int const warmup                = std::max( parser.get<int>("warmup"), 0 );
+  cv::Size const size( parser.get<int>("width"), parser.get<int>("height") );
+  int const color_count           = parser.get<int>("colors");
+  int const blobs_per_color       = parser.get<int>("blobs");
+  double const min_radius         = parser.get<double>("min-radius");
+  double const max_radius         = std::max( parser.get<double>("max-radius"), min_radius );
+  double const rotation           = parser.get<double>("rotation") * M_PI / 180;
+  double const drift              = parser.get<double>("drift");
+  double const spin               = parser.get<double>("spin") * M_PI / 180;
+  double const noise              = parser.get<double>("noise");
+  bool const check_agreement      = parser.get<bool>("agreement");
+
+  if( color_count < 1 || color_count > int( uscauv::COLOR_CODEC_MAX_COLORS ) )
+    {
+      std::cerr << "Need between 1 and " << uscauv::COLOR_CODEC_MAX_COLORS << " colors." << std::endl;
+      return 1;
+    }
+  
+  // ################################################################
+  // Templates and configuration ####################################
+  // ################################################################
+
+  std::map<std::string, cv::Mat> template_images;
+  if( template_path != "false" )
+    {
+      if( loadTemplates( template_path, template_images ) )
+	{
+	  std::cerr << "No templates loaded from [ " << template_path << " ]." << std::endl;
+	  return 1;
+	}
+    }
+  else
+    makeSyntheticTemplates( template_images );
+
+  ShapeMatcher matcher( parser.get<int>("threads") );
+  StageProfiler profiler;
+  
+  /// Only templates that the matcher accepts are drawn
+  std::vector<_Contour2f> shapes;
+  std::vector<std::string> shape_names;
+  for( std::map<std::string, cv::Mat>::value_type const & element : template_images )
+    {
+      if( matcher.addTemplate( element.first, element.second ) )
+	continue;
+      
+      _Contour2f shape;
+      normalizeTemplate( element.second, shape );
+      if( shape.empty() )
+	continue;
+      shapes.push_back( shape );
+      shape_names.push_back( element.first );
+    }
+
+  if( shapes.empty() )
+    {
+      std::cerr << "None of the templates have a single contour." << std::endl;
+      return 1;
+    }
+
+  _ShapeMatcherConfig config = _ShapeMatcherConfig::__getDefault__();
+  config.kernel_size = parser.get<int>("kernel");
+  config.struct_elem_size = parser.get<int>("struct");
+  config.signature_size = parser.get<int>("signature");
+  config.emd_boundary = parser.get<double>("boundary");
+  config.use_morph = true;
+  config.use_blur = true;
+  config.use_otsu = true;
+  config.use_floor = false;
+  config.denoise_engine = parser.get<int>("denoise");
+  config.fast_emd = !parser.get<bool>("exact-emd");
+  config.use_match_cache = parser.get<bool>("cache");
+  /// No debug images
+  config.debug_color = "";
+  matcher.reconfigure( config );
+
+  // ################################################################
+  // Synthetic frames ###############################################
+  // ################################################################
+  
+  std::mt19937 generator( parser.get<int>("seed") );
+  std::uniform_real_distribution<float> unit( 0, 1 );
+
+  std::vector<std::string> colors;
+  for(int color = 0; color < color_count; ++color )
+    colors.push_back( "color" + std::to_string( color ) );
+  
+  std::vector<Blob> blobs;
+  for(int color = 0; color < color_count; ++color )
+    for(int idx = 0; idx < blobs_per_color; ++idx )
+      {
+	float const heading = 2 * M_PI * unit( generator );
+	Blob blob;
+	blob.color_ = color;
+	blob.shape_ = std::uniform_int_distribution<int>( 0, shapes.size() - 1 )( generator );
+	blob.position_ = cv::Point2f( unit( generator ) * size.width, unit( generator ) * size.height );
+	blob.velocity_ = cv::Point2f( drift * std::cos( heading ), drift * std::sin( heading ) );
+	blob.angle_ = rotation * ( 2 * unit( generator ) - 1 );
+	blob.spin_ = spin;
+	blob.radius_ = min_radius + ( max_radius - min_radius ) * unit( generator );
+	blobs.push_back( blob );
+      }
+
+  std::cout << "Generating [ " << warmup + frames << " ] frames of [ " << size.width << "x" << size.height << " ] with [ " 
+	    << color_count << " ] colors, [ " << blobs_per_color << " ] blobs per color, and [ " << shapes.size() 
+	    << " ] templates..." << std::endl;
+  
+  std::vector<uscauv::EncodedColorImageConstPtr> sequence;
+  for(int frame = 0; frame < warmup + frames; ++frame )
+    {
+      sequence.push_back( renderFrame( blobs, shapes, colors, size, noise, generator ) );
+      moveBlobs( blobs, size );
+    }
+
+  // ################################################################
+  // Match ##########################################################
+  // ################################################################
+
+  std::vector<cv::Rect> const regions;
+  DebugImageRequest const debug_request = { false, false, false };
+  std::vector<_MatchedShape> matches;
+
+  for(int frame = 0; frame < warmup; ++frame )
+    matcher.match( *sequence[ frame ], regions, false, debug_request, matches );
+
+  uint64_t const compared_before = matcher.getTemplateIndex().getCompared();
+  uint64_t const pruned_before = matcher.getTemplateIndex().getPruned();
+  uint64_t const lookups_before = matcher.getCacheLookups();
+  uint64_t const hits_before = matcher.getCacheHits();
+  uint64_t const allocations_before = total_allocations;
+  
+  matcher.setProfiler( &profiler );
+  uint64_t total_matches = 0;
+  std::chrono::duration<double, std::milli> elapsed( 0 );
+  EMDAgreement agreement = { 0, 0, 0, 0, 0 };
+
+  for(int frame = warmup; frame < warmup + frames; ++frame )
+    {
+      _Clock::time_point const start = _Clock::now();
+      matcher.match( *sequence[ frame ], regions, false, debug_request, matches );
+      elapsed += _Clock::now() - start;
+      
+      total_matches += matches.size();
+
+      /// Not timed, but it does allocate
+      if( check_agreement )
+	{
+	  matcher.setProfiler( NULL );
+	  checkAgreement( matcher, colors, agreement );
+	  matcher.setProfiler( &profiler );
+	}
+    }
+  
+  matcher.setProfiler( NULL );
+  uint64_t const allocations = total_allocations - allocations_before;
+
+  // ################################################################
+  // Report #########################################################
+  // ################################################################
+
+  double const seconds = elapsed.count() / 1e3;
+
+  std::cout << std::fixed << std::setprecision(3)
+	    << "Denoise engine: " << ( config.denoise_engine ? "Binary" : "OpenCV" ) << ", EMD: " 
+	    << ( config.fast_emd ? "closed form" : "cv::EMD" ) << ", match cache: " << ( config.use_match_cache ? "on" : "off" )
+	    << ", threads: " << matcher.getThreads() << std::endl
+	    << "Frames: " << frames << ", " << elapsed.count() / frames << " ms/frame, " << frames / seconds << " frames/s" << std::endl
+	    << "Matches: " << total_matches << ", " << total_matches / seconds << " matches/s" << std::endl;
+  if( !check_agreement )
+    std::cout << "Allocations: " << allocations << ", " << double( allocations ) / frames << " per frame" << std::endl;
+
+  std::cout << std::endl << std::left << std::setw(16) << "Stage" << std::right << std::setw(10) << "Calls" << std::setw(12) << "ms/frame" 
+	    << std::setw(12) << "us/call" << std::setw(14) << "Allocations" << std::setw(12) << "Alloc/call" << std::endl;
+  for(int stage = 0; stage < StageProfiler::STAGES; ++stage )
+    {
+      uint64_t const calls = profiler.getCalls( stage );
+      double const milliseconds = profiler.getMilliseconds( stage );
+      uint64_t const stage_allocations = profiler.getAllocations( stage );
+      
+      std::cout << std::left << std::setw(16) << STAGE_NAMES[ stage ] << std::right << std::setw(10) << calls 
+		<< std::setw(12) << milliseconds / frames
+		<< std::setw(12) << ( calls ? 1e3 * milliseconds / calls : 0 )
+		<< std::setw(14) << stage_allocations
+		<< std::setw(12) << ( calls ? double( stage_allocations ) / calls : 0 ) << std::endl;
+    }
+  std::cout << std::endl;
+
+  uint64_t const compared = matcher.getTemplateIndex().getCompared() - compared_before;
+  uint64_t const pruned = matcher.getTemplateIndex().getPruned() - pruned_before;
+  std::cout << "Pruned [ " << pruned << " / " << compared << " ] template comparisons before EMD." << std::endl;
+  if( config.use_match_cache )
+    std::cout << "Match cache hits: [ " << matcher.getCacheHits() - hits_before << " / " 
+	      << matcher.getCacheLookups() - lookups_before << " ]." << std::endl;
+
+  if( check_agreement )
+    {
+      uint64_t const compared_pairs = agreement.pairs_ - agreement.fallbacks_;
+      std::cout << std::setprecision(6) << "EMD agreement over [ " << agreement.pairs_ << " ] pairs: max error " << agreement.max_error_ 
+		<< ", mean error " << ( compared_pairs ? agreement.total_error_ / compared_pairs : 0 ) 
+		<< ", [ " << agreement.disagreements_ << " ] decisions differ, [ " << agreement.fallbacks_ << " ] fell back to cv::EMD." 
+		<< std::endl;
+    }
+  
+  return 0;
+}
@@ -0,0 +1,256 @@
+/***************************************************************************
+ *  test/analyze_contour_test.cpp
+ *  -----------------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <gtest/gtest.h>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <shape_matching/matcher.h>
+#include <shape_matching/circular_emd.h>
+
+/// C++11
+#include <random>
+
+/// Signature bins, as in params/image_proc.yaml
+int const BINS = 30;
+/// Largest circular EMD, in bins, allowed between the reference and current signatures. Both use fastAtan2 style
+/// approximations but on differently rotated points, so a few points right at bin edges can land in neighboring bins.
+double const SIGNATURE_TOLERANCE = 0.05;
+
+/// What the reference implementation computes
+struct ReferenceContour
+{
+  cv::Point2f mean_;
+  float rotation_;
+  double radius_;
+  /// Largest eigenvalue over the smallest. Near 1 the principal axis, and with it the rotation, is ill defined.
+  double anisotropy_;
+  _Signature signature_;
+};
+
+/** 
+ * ShapeMatcher::analyzeContour() as it was before it was rewritten as a single pass: calcCovarMatrix and eigen for the
+ * principal axis, per point fastAtan2 in the image frame, a sort by angle, and a sweep over the sorted points.
+ * 
+ * @return 0 on success, -1 if the contour is too small
+ */
+int referenceAnalyzeContour( _Contour const & input, int nd, ReferenceContour & result )
+{
+  if( input.size() <= 1 )
+    return -1;
+
+  cv::Mat mean( 1, 2, CV_32F ), cov( 2, 2, CV_32F ), eigenvec, eigenval, sort_idx;
+  cv::Mat contour; 
+  cv::Mat( input ).convertTo( contour, CV_32F );
+  /// nx2, one point per row
+  contour = contour.reshape( 1, 0 );
+  
+  cv::calcCovarMatrix( contour, cov, mean, CV_COVAR_NORMAL + CV_COVAR_ROWS, CV_32F );
+  if( !cv::eigen( cov, eigenval, eigenvec ) )
+    return -1;
+  
+  float const * ev1 = eigenvec.ptr<float>(0);
+  float rotation = atan( ev1[1] / ev1[0] );
+  rotation = rotation - uscauv::PI_TWO;
+  if( rotation < -uscauv::PI_TWO )
+    rotation = uscauv::PI + rotation;
+
+  float const * mean_ptr = mean.ptr<float>(0);
+  cv::subtract( contour.col(0), cv::Scalar( mean_ptr[0] ), contour.col(0) );
+  cv::subtract( contour.col(1), cv::Scalar( mean_ptr[1] ), contour.col(1) );
+
+  /// Angle in the left column and radius in the right
+  for(int idx = 0; idx < contour.rows; ++idx )
+    {
+      float * row = contour.ptr<float>( idx );
+      float theta = cv::fastAtan2( row[1], row[0] );
+      theta = theta - ( rotation * 180 / M_PI );
+      theta = ( ( theta < 0 ) ? 360 + theta : ( theta > 360 ) ? -360 + theta : theta ) * M_PI / 180;
+      float const rad = sqrt( pow( row[0], 2 ) + pow( row[1], 2 ) );
+      row[0] = theta; 
+      row[1] = rad;
+    }
+
+  double max_radius;
+  cv::minMaxLoc( contour.col(1), NULL, &max_radius );
+  contour.col(1) = ( 1.0f / max_radius ) * contour.col(1);
+  
+  cv::Mat contour_sorted( contour.rows, contour.cols, CV_32F );
+  cv::sortIdx( contour.col(0), sort_idx, CV_SORT_EVERY_COLUMN + CV_SORT_ASCENDING );
+  int const * sort = sort_idx.ptr<int>(0);
+  for(int idx = 0; idx < sort_idx.rows; ++idx )
+    contour.row( sort[idx] ).copyTo( contour_sorted.row( idx ) );
+
+  _Signature signature;
+  int idx = 0;
+  for(int bin = 1; bin <= nd; ++bin )
+    {
+      float const ub = bin * 2 * M_PI / nd;
+      float acc = 0.0f;
+      int n = 0;
+      while( idx < contour_sorted.rows && contour_sorted.at<float>( idx, 0 ) < ub )
+	{
+	  acc += contour_sorted.at<float>( idx, 1 );
+	  ++n;
+	  ++idx;
+	}
+      signature.push_back( n ? acc / n : 0.0f );
+    }
+  signature *= 1 / cv::sum( signature )[0];
+
+  result.mean_ = cv::Point2f( mean_ptr[0], mean_ptr[1] );
+  result.rotation_ = rotation;
+  result.radius_ = max_radius;
+  result.anisotropy_ = eigenval.at<float>(0) / std::max( eigenval.at<float>(1), 1e-6f );
+  result.signature_ = signature;
+  return 0;
+}
+
+/// Outer contour of a random filled ellipse, rectangle, triangle, or cross
+_Contour makeRandomContour( std::mt19937 & rng )
+{
+  std::uniform_real_distribution<float> unit( 0, 1 );
+  int const size = 400;
+  cv::Point2f const center( 200 + 40 * ( unit( rng ) - 0.5f ), 200 + 40 * ( unit( rng ) - 0.5f ) );
+  float const angle = 360 * unit( rng );
+  float const length = 60 + 100 * unit( rng ), width = length * ( 0.2f + 0.5f * unit( rng ) );
+  
+  cv::Mat image = cv::Mat::zeros( size, size, CV_8UC1 );
+  switch( rng() % 4 )
+    {
+    case 0:
+      cv::ellipse( image, cv::RotatedRect( center, cv::Size2f( length, width ), angle ), cv::Scalar( 255 ), -1 );
+      break;
+    case 1:
+      {
+	cv::Point2f corners[4];
+	cv::RotatedRect( center, cv::Size2f( length, width ), angle ).points( corners );
+	std::vector<cv::Point> const polygon( corners, corners + 4 );
+	cv::fillConvexPoly( image, polygon, cv::Scalar( 255 ) );
+	break;
+      }
+    case 2:
+      {
+	std::vector<cv::Point> polygon;
+	for(int corner = 0; corner < 3; ++corner )
+	  polygon.push_back( cv::Point( center.x + length * ( unit( rng ) - 0.5f ), center.y + length * ( unit( rng ) - 0.5f ) ) );
+	cv::fillConvexPoly( image, polygon, cv::Scalar( 255 ) );
+	break;
+      }
+    default:
+      {
+	/// Arms of different lengths, so that the principal axis is well defined
+	cv::Point2f corners[4];
+	cv::RotatedRect( center, cv::Size2f( length, width / 2 ), angle ).points( corners );
+	cv::fillConvexPoly( image, std::vector<cv::Point>( corners, corners + 4 ), cv::Scalar( 255 ) );
+	cv::RotatedRect( center, cv::Size2f( width, length / 4 ), angle ).points( corners );
+	cv::fillConvexPoly( image, std::vector<cv::Point>( corners, corners + 4 ), cv::Scalar( 255 ) );
+	break;
+      }
+    }
+
+  std::vector<_Contour> contours;
+  cv::findContours( image, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE );
+  
+  _Contour largest;
+  for( _Contour const & contour : contours )
+    if( contour.size() > largest.size() )
+      largest = contour;
+  return largest;
+}
+
+/// @return Difference between two rotations on [-pi/2, pi/2], which are the same axis modulo pi
+double rotationDifference( double const & first, double const & second )
+{
+  double const difference = std::fabs( first - second );
+  return std::min( difference, uscauv::PI - difference );
+}
+
+TEST( AnalyzeContour, MatchesReference )
+{
+  std::mt19937 rng( 0 );
+  ShapeMatcher matcher( 1 );
+  SignatureScratch scratch;
+  ContourData result;
+
+  int compared = 0;
+  for(int trial = 0; trial < 300; ++trial )
+    {
+      _Contour const contour = makeRandomContour( rng );
+      
+      ReferenceContour reference;
+      if( referenceAnalyzeContour( contour, BINS, reference ) || reference.anisotropy_ < 1.5 )
+	continue;
+      
+      SCOPED_TRACE( ::testing::Message() << "trial " << trial << ", " << contour.size() << " points" );
+      ASSERT_EQ( 0, matcher.analyzeContour( contour, result, BINS, scratch, true ) );
+      ++compared;
+
+      EXPECT_NEAR( reference.mean_.x, result.mean_.x, 1e-2 );
+      EXPECT_NEAR( reference.mean_.y, result.mean_.y, 1e-2 );
+      EXPECT_LT( rotationDifference( reference.rotation_, result.rotation_ ), 1e-3 );
+      EXPECT_NEAR( reference.radius_, result.radius_, 1e-3 * reference.radius_ );
+      EXPECT_EQ( contour.size(), result.contour_.size() );
+
+      ASSERT_EQ( BINS, int( result.signature_.total() ) );
+      double emd;
+      ASSERT_EQ( 0, circular_emd::compute( reference.signature_, result.signature_, emd ) );
+      EXPECT_LT( emd, SIGNATURE_TOLERANCE );
+    }
+
+  /// Most random shapes are elongated enough to compare
+  EXPECT_GT( compared, 150 );
+}
+
+/// The reference produced a NaN signature for these. They are now rejected.
+TEST( AnalyzeContour, RejectsDegenerateContours )
+{
+  ShapeMatcher matcher( 1 );
+  SignatureScratch scratch;
+  ContourData result;
+
+  EXPECT_EQ( -1, matcher.analyzeContour( _Contour(), result, BINS, scratch ) );
+  EXPECT_EQ( -1, matcher.analyzeContour( _Contour( 1, cv::Point( 3, 4 ) ), result, BINS, scratch ) );
+  EXPECT_EQ( -1, matcher.analyzeContour( _Contour( 5, cv::Point( 3, 4 ) ), result, BINS, scratch ) );
+}
+
+int main( int argc, char ** argv )
+{
+  ::testing::InitGoogleTest( &argc, argv );
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,266 @@
+/***************************************************************************
+ *  test/circular_emd_test.cpp
+ *  ---------------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <gtest/gtest.h>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <shape_matching/matcher.h>
+#include <shape_matching/circular_emd.h>
+#include <shape_matching/template_index.h>
+
+/// C++11
+#include <random>
+
+/// cv::EMD solves in single precision, so allow for its rounding relative to the size of the answer
+double const TOLERANCE = 1e-3;
+
+/// Random histogram with some empty bins, normalized to sum to one like ShapeMatcher::analyzeContour() does
+_Signature makeRandomSignature( int const & bins, std::mt19937 & rng )
+{
+  std::uniform_real_distribution<float> weight( 0, 1 );
+  std::bernoulli_distribution empty( 0.25 );
+  
+  _Signature signature( bins, 1, CV_32FC1 );
+  float mass = 0;
+  for(int idx = 0; idx < bins; ++idx )
+    {
+      signature.at<float>( idx ) = empty( rng ) ? 0 : weight( rng );
+      mass += signature.at<float>( idx );
+    }
+  
+  /// Never leave the histogram empty
+  if( mass == 0 )
+    {
+      signature.at<float>( 0 ) = 1;
+      mass = 1;
+    }
+  
+  signature /= mass;
+  return signature;
+}
+
+/// @return signature rotated by shift bins
+_Signature rotateSignature( _Signature const & signature, int const & shift )
+{
+  int const bins = signature.rows;
+  _Signature rotated( bins, 1, CV_32FC1 );
+  for(int idx = 0; idx < bins; ++idx )
+    rotated.at<float>( ( idx + shift ) % bins ) = signature.at<float>( idx );
+  return rotated;
+}
+
+/// Closed form and cv::EMD under the matcher's circular cost must agree
+void expectAgreement( _Signature const & signature1, _Signature const & signature2, cv::Mat const & cost )
+{
+  double fast;
+  ASSERT_EQ( 0, circular_emd::compute( signature1, signature2, fast ) );
+  
+  double const exact = cv::EMD( signature1, signature2, CV_DIST_USER, cost );
+  EXPECT_NEAR( exact, fast, TOLERANCE * std::max( 1.0, exact ) );
+}
+
+/// The Fourier lower bound must never exceed the closed form EMD, or TemplateIndex would prune real matches
+void expectBounded( _Signature const & signature1, _Signature const & signature2 )
+{
+  circular_emd::Modes modes1, modes2;
+  ASSERT_EQ( 0, circular_emd::computeModes( signature1, modes1 ) );
+  ASSERT_EQ( 0, circular_emd::computeModes( signature2, modes2 ) );
+
+  double emd;
+  ASSERT_EQ( 0, circular_emd::compute( signature1, signature2, emd ) );
+  EXPECT_LE( circular_emd::lowerBound( modes1, modes2 ), emd + 1e-9 );
+}
+
+/// Stand-ins for model/shapes, the same ones that shape_matcher_benchmark uses
+void addSyntheticTemplates( ShapeMatcher & matcher )
+{
+  int const size = 200;
+  cv::Point const center( size / 2, size / 2 );
+  std::map<std::string, cv::Mat> images;
+  
+  cv::Mat circle = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::circle( circle, center, 70, cv::Scalar( 255 ), -1 );
+  images[ "circle" ] = circle;
+
+  cv::Mat bar = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::rectangle( bar, cv::Point( 30, 75 ), cv::Point( 170, 125 ), cv::Scalar( 255 ), -1 );
+  images[ "bar" ] = bar;
+
+  cv::Mat triangle = cv::Mat::zeros( size, size, CV_8UC1 );
+  std::vector<cv::Point> const triangle_points = { cv::Point( 100, 25 ), cv::Point( 170, 160 ), cv::Point( 30, 160 ) };
+  cv::fillConvexPoly( triangle, triangle_points, cv::Scalar( 255 ) );
+  images[ "triangle" ] = triangle;
+
+  cv::Mat cross = cv::Mat::zeros( size, size, CV_8UC1 );
+  cv::rectangle( cross, cv::Point( 85, 30 ), cv::Point( 115, 170 ), cv::Scalar( 255 ), -1 );
+  cv::rectangle( cross, cv::Point( 30, 85 ), cv::Point( 170, 115 ), cv::Scalar( 255 ), -1 );
+  images[ "cross" ] = cross;
+
+  for( std::map<std::string, cv::Mat>::value_type const & image : images )
+    ASSERT_EQ( 0, matcher.addTemplate( image.first, image.second ) );
+}
+
+/// Config with the closed form enabled and the given number of signature bins
+_ShapeMatcherConfig makeConfig( int const & bins )
+{
+  _ShapeMatcherConfig config = _ShapeMatcherConfig::__getDefault__();
+  config.signature_size = bins;
+  config.fast_emd = true;
+  return config;
+}
+
+TEST( CircularEMD, RandomSignatures )
+{
+  std::mt19937 rng( 0 );
+  ShapeMatcher matcher( 1 );
+  
+  int const bin_counts[] = { 5, 8, 20, 36, 64 };
+  for( int const bins : bin_counts )
+    {
+      matcher.reconfigure( makeConfig( bins ) );
+      
+      for(int trial = 0; trial < 100; ++trial )
+	{
+	  _Signature const signature1 = makeRandomSignature( bins, rng );
+	  _Signature const signature2 = makeRandomSignature( bins, rng );
+	  
+	  SCOPED_TRACE( ::testing::Message() << "bins " << bins << ", trial " << trial );
+	  expectAgreement( signature1, signature2, matcher.getEMDCost() );
+	  expectAgreement( signature1, signature1, matcher.getEMDCost() );
+	  expectBounded( signature1, signature2 );
+	  expectBounded( signature1, signature1 );
+	}
+    }
+}
+
+TEST( CircularEMD, TemplateSignatures )
+{
+  ShapeMatcher matcher( 1 );
+  addSyntheticTemplates( matcher );
+  ASSERT_FALSE( ::testing::Test::HasFatalFailure() );
+
+  _ShapeMatcherConfig const config = makeConfig( _ShapeMatcherConfig::__getDefault__().signature_size );
+  matcher.reconfigure( config );
+  ASSERT_EQ( 4u, matcher.getTemplates().size() );
+
+  /// Every pair of templates, with the second one rotated through every bin
+  for( _NamedContourData::value_type const & first : matcher.getTemplates() )
+    for( _NamedContourData::value_type const & second : matcher.getTemplates() )
+      for(int shift = 0; shift < config.signature_size; ++shift )
+	{
+	  SCOPED_TRACE( ::testing::Message() << first.first << " vs " << second.first << ", shift " << shift );
+	  _Signature const rotated = rotateSignature( second.second.signature_, shift );
+	  expectAgreement( first.second.signature_, rotated, matcher.getEMDCost() );
+	  expectBounded( first.second.signature_, rotated );
+	}
+}
+
+/// Pruning with the lower bound must find exactly the matches that comparing against every template does
+TEST( TemplateIndex, PruningKeepsMatches )
+{
+  std::mt19937 rng( 1 );
+  std::uniform_real_distribution<float> unit( 0, 1 );
+  
+  ShapeMatcher matcher( 1 );
+  addSyntheticTemplates( matcher );
+  ASSERT_FALSE( ::testing::Test::HasFatalFailure() );
+
+  _ShapeMatcherConfig const config = makeConfig( _ShapeMatcherConfig::__getDefault__().signature_size );
+  matcher.reconfigure( config );
+
+  TemplateIndex<ContourData> index;
+  index.build( matcher.getTemplates() );
+
+  /// Random signatures mostly match nothing, so also probe with noisy, rotated copies of the templates
+  std::vector<_Signature> probes;
+  for(int trial = 0; trial < 200; ++trial )
+    probes.push_back( makeRandomSignature( config.signature_size, rng ) );
+  for( _NamedContourData::value_type const & element : matcher.getTemplates() )
+    for(int trial = 0; trial < 50; ++trial )
+      {
+	_Signature probe = rotateSignature( element.second.signature_, rng() % config.signature_size );
+	for(int bin = 0; bin < probe.rows; ++bin )
+	  probe.at<float>( bin ) *= 1 + 0.5f * ( unit( rng ) - 0.5f );
+	probe /= cv::sum( probe )[0];
+	probes.push_back( probe );
+      }
+
+  double const boundaries[] = { 0.1, 0.4, 1.0, 3.0 };
+  uint64_t matches = 0;
+  for( double const boundary : boundaries )
+    for(unsigned int probe_idx = 0; probe_idx < probes.size(); ++probe_idx )
+      {
+	SCOPED_TRACE( ::testing::Message() << "boundary " << boundary << ", probe " << probe_idx );
+	
+	std::vector<TemplateIndex<ContourData>::Entry const *> pruned, all;
+	index.findCandidates( probes[ probe_idx ], boundary, true, pruned );
+	index.findCandidates( probes[ probe_idx ], boundary, false, all );
+	ASSERT_EQ( index.getEntries().size(), all.size() );
+
+	std::vector<std::string> pruned_matches, all_matches;
+	for( TemplateIndex<ContourData>::Entry const * candidate : pruned )
+	  if( matcher.computeEMD( probes[ probe_idx ], candidate->data_->signature_ ) < boundary )
+	    pruned_matches.push_back( candidate->name_ );
+	for( TemplateIndex<ContourData>::Entry const * candidate : all )
+	  if( matcher.computeEMD( probes[ probe_idx ], candidate->data_->signature_ ) < boundary )
+	    all_matches.push_back( candidate->name_ );
+
+	EXPECT_EQ( all_matches, pruned_matches );
+	matches += all_matches.size();
+      }
+
+  /// Otherwise the comparison above proves nothing
+  EXPECT_GT( matches, 0u );
+  EXPECT_GT( index.getPruned(), 0u );
+}
+
+TEST( CircularEMD, RejectsUnequalMass )
+{
+  _Signature signature1 = _Signature::ones( 8, 1, CV_32FC1 );
+  _Signature signature2 = 2 * _Signature::ones( 8, 1, CV_32FC1 );
+  
+  double emd;
+  EXPECT_EQ( -1, circular_emd::compute( signature1, signature2, emd ) );
+}
+
+int main( int argc, char ** argv )
+{
+  ::testing::InitGoogleTest( &argc, argv );
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,139 @@
+/***************************************************************************
+ *  test/denoise_test.cpp
+ *  ---------------------
+ *
+ *  Copyright (c) 2013, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <gtest/gtest.h>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <shape_matching/denoise.h>
+
+/// C++11
+#include <random>
+
+/// Random 0/255 mask: salt and pepper noise at a random density, plus a few solid blobs that survive the opening
+cv::Mat makeRandomMask( int const & rows, int const & cols, std::mt19937 & rng )
+{
+  std::uniform_real_distribution<float> unit( 0, 1 );
+  float const density = 0.2f + 0.7f * unit( rng );
+  
+  cv::Mat mask( rows, cols, CV_8UC1 );
+  for(int y = 0; y < rows; ++y )
+    for(int x = 0; x < cols; ++x )
+      mask.at<unsigned char>( y, x ) = ( unit( rng ) < density ) ? 255 : 0;
+
+  for(int blob = 0; blob < 3; ++blob )
+    cv::circle( mask, cv::Point( cols * unit( rng ), rows * unit( rng ) ), 2 + 20 * unit( rng ), 
+		cv::Scalar( ( rng() % 2 ) ? 255 : 0 ), -1 );
+  return mask;
+}
+
+/// Only the opening
+denoise::Params makeMorphParams( int const & struct_elem_size )
+{
+  denoise::Params const params = { true, struct_elem_size, false, 1, false, 0, false };
+  return params;
+}
+
+/// Expect the binary engine to produce exactly what cv::morphologyEx does, border handling included
+void expectSameOpening( cv::Mat const & mask, int const & struct_elem_size, denoise::BinaryDenoiser & denoiser )
+{
+  denoise::Params const params = makeMorphParams( struct_elem_size );
+  
+  cv::Mat expected = mask.clone(), actual = mask.clone();
+  denoise::denoiseOpenCV( expected, params );
+  denoiser.apply( actual, params );
+
+  ASSERT_EQ( expected.size(), actual.size() );
+  EXPECT_EQ( 0, cv::countNonZero( expected != actual ) );
+}
+
+TEST( BinaryDenoiser, OpeningMatchesOpenCV )
+{
+  std::mt19937 rng( 0 );
+  denoise::BinaryDenoiser denoiser;
+  
+  /// Widths on both sides of word boundaries, and the 5 to 20 pixel elements that the config allows by default
+  int const widths[] = { 1, 17, 63, 64, 65, 127, 128, 130, 200, 640 };
+  int const heights[] = { 1, 7, 48 };
+  int const struct_elem_sizes[] = { 1, 2, 3, 5, 6, 9, 20 };
+  
+  for( int const cols : widths )
+    for( int const rows : heights )
+      for( int const struct_elem_size : struct_elem_sizes )
+	{
+	  SCOPED_TRACE( ::testing::Message() << rows << "x" << cols << ", element " << struct_elem_size );
+	  expectSameOpening( makeRandomMask( rows, cols, rng ), struct_elem_size, denoiser );
+	}
+}
+
+/// Regions of the frame are denoised through views into the full mask, whose rows aren't contiguous. A view is denoised
+/// as if it were the whole image, and nothing outside of it is touched.
+TEST( BinaryDenoiser, OpeningWorksOnViews )
+{
+  std::mt19937 rng( 1 );
+  denoise::BinaryDenoiser denoiser;
+  
+  cv::Mat const frame = makeRandomMask( 120, 300, rng );
+  cv::Rect const regions[] = { cv::Rect( 0, 0, 64, 40 ), cv::Rect( 13, 7, 131, 60 ), cv::Rect( 200, 50, 100, 70 ) };
+
+  for( cv::Rect const & region : regions )
+    for( int const struct_elem_size : { 3, 5, 9 } )
+      {
+	SCOPED_TRACE( ::testing::Message() << "region " << region.x << "," << region.y << " " << region.width << "x" 
+		      << region.height << ", element " << struct_elem_size );
+	denoise::Params const params = makeMorphParams( struct_elem_size );
+	
+	cv::Mat expected_frame = frame.clone();
+	cv::Mat expected = frame( region ).clone();
+	denoise::denoiseOpenCV( expected, params );
+	expected.copyTo( expected_frame( region ) );
+
+	cv::Mat actual_frame = frame.clone();
+	cv::Mat actual = actual_frame( region );
+	ASSERT_FALSE( actual.isContinuous() );
+	denoiser.apply( actual, params );
+	
+	EXPECT_EQ( 0, cv::countNonZero( expected_frame != actual_frame ) );
+      }
+}
+
+int main( int argc, char ** argv )
+{
+  ::testing::InitGoogleTest( &argc, argv );
+  return RUN_ALL_TESTS();
+}
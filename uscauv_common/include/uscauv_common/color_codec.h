@@ -49,64 +49,774 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <auv_msgs/ColorEncodedImage.h>
+#include <boost/make_shared.hpp>
+
+// cpp11
+#include <mutex>
+#include <limits>
+
+// SIMD
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace uscauv
 {
+  /// Each color is one bit of the encoded image. The narrowest of these layouts that fits every color is used.
   static char const * const COLOR_CODEC_IMAGE_TYPE = "mono16";
+  static char const * const COLOR_CODEC_IMAGE_TYPE_32 = "32SC1";
+  static char const * const COLOR_CODEC_IMAGE_TYPE_64 = "32SC2";
+  static unsigned int const COLOR_CODEC_MAX_COLORS = 64;
 
   typedef std::map<std::string, cv::Mat> ColorImageMap;
   typedef std::shared_ptr<ColorImageMap> ColorImageMapPtr;
   typedef std::shared_ptr<ColorImageMap const> ColorImageMapConstPtr;
+
+  /// @return Encoding of the narrowest layout that holds the given number of colors
+  inline std::string getColorCodecImageType( unsigned int const & colors )
+  {
+    ROS_ASSERT( colors <= COLOR_CODEC_MAX_COLORS );
+    
+    if( colors <= 16 )
+      return COLOR_CODEC_IMAGE_TYPE;
+    else if( colors <= 32 )
+      return COLOR_CODEC_IMAGE_TYPE_32;
+    else
+      return COLOR_CODEC_IMAGE_TYPE_64;
+  }
+
+  /// @return OpenCV type of the narrowest layout that holds the given number of colors
+  inline int getColorCodecCvType( unsigned int const & colors )
+  {
+    return cv_bridge::getCvType( getColorCodecImageType( colors ) );
+  }
+
+  /// @return Number of colors that an image of the given encoding can hold, or 0 if it isn't a color codec encoding
+  inline unsigned int getColorCodecCapacity( std::string const & encoding )
+  {
+    if( encoding == COLOR_CODEC_IMAGE_TYPE )
+      return 16;
+    else if( encoding == COLOR_CODEC_IMAGE_TYPE_32 )
+      return 32;
+    else if( encoding == COLOR_CODEC_IMAGE_TYPE_64 )
+      return 64;
+    else
+      return 0;
+  }
+
+  namespace color_codec
+  {
+#ifdef __SSE2__
+    /// Interleave four planes of 16 bytes into 16 little-endian 32-bit words
+    inline void interleaveBytes4( __m128i const * planes, __m128i * words )
+    {
+      __m128i const a_lo = _mm_unpacklo_epi8( planes[0], planes[1] ), a_hi = _mm_unpackhi_epi8( planes[0], planes[1] );
+      __m128i const b_lo = _mm_unpacklo_epi8( planes[2], planes[3] ), b_hi = _mm_unpackhi_epi8( planes[2], planes[3] );
+      words[0] = _mm_unpacklo_epi16( a_lo, b_lo );
+      words[1] = _mm_unpackhi_epi16( a_lo, b_lo );
+      words[2] = _mm_unpacklo_epi16( a_hi, b_hi );
+      words[3] = _mm_unpackhi_epi16( a_hi, b_hi );
+    }
+
+    /** 
+     * Store 16 pixels whose bytes were built separately. planes[g] holds bits [8g, 8g + 8) of every pixel.
+     */
+    inline void storePlanes( __m128i const * planes, uint16_t * out )
+    {
+      _mm_storeu_si128( reinterpret_cast<__m128i *>( out ),     _mm_unpacklo_epi8( planes[0], planes[1] ) );
+      _mm_storeu_si128( reinterpret_cast<__m128i *>( out + 8 ), _mm_unpackhi_epi8( planes[0], planes[1] ) );
+    }
+
+    inline void storePlanes( __m128i const * planes, uint32_t * out )
+    {
+      __m128i words[4];
+      interleaveBytes4( planes, words );
+      for(int idx = 0; idx < 4; ++idx )
+	_mm_storeu_si128( reinterpret_cast<__m128i *>( out + 4 * idx ), words[idx] );
+    }
+
+    inline void storePlanes( __m128i const * planes, uint64_t * out )
+    {
+      __m128i low[4], high[4];
+      interleaveBytes4( planes, low );
+      interleaveBytes4( planes + 4, high );
+      for(int idx = 0; idx < 4; ++idx )
+	{
+	  _mm_storeu_si128( reinterpret_cast<__m128i *>( out + 4 * idx ),     _mm_unpacklo_epi32( low[idx], high[idx] ) );
+	  _mm_storeu_si128( reinterpret_cast<__m128i *>( out + 4 * idx + 2 ), _mm_unpackhi_epi32( low[idx], high[idx] ) );
+	}
+    }
+#endif
+
+    /** 
+     * Pack bit i of every output pixel from masks[i] in a single pass over the image
+     * 
+     * @param masks CV_8UC1 masks of equal size, non-zero where the color is present
+     * @param encoded Output image with word type __Word
+     */
+    template<class __Word>
+      void packMasks( std::vector<cv::Mat> const & masks, cv::Mat & encoded )
+      {
+	std::vector<unsigned char const *> in( masks.size() );
+	int const cols = encoded.cols;
+	
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    for(unsigned int color = 0; color < masks.size(); ++color )
+	      in[color] = masks[color].ptr<unsigned char>( idy );
+	    
+	    __Word * out = encoded.ptr<__Word>( idy );
+	    int idx = 0;
+	    
+#ifdef __SSE2__
+	    /// 16 pixels at a time. Each group of 8 masks fills one byte of every pixel, and the bytes are interleaved into words at the end.
+	    __m128i const zero = _mm_setzero_si128();
+	    for(; idx + 16 <= cols; idx += 16 )
+	      {
+		__m128i planes[ sizeof(__Word) ];
+		for(unsigned int plane = 0; plane < sizeof(__Word); ++plane )
+		  planes[plane] = zero;
+		
+		for(unsigned int color = 0; color < masks.size(); ++color )
+		  {
+		    __m128i const mask = _mm_loadu_si128( reinterpret_cast<__m128i const *>( in[color] + idx ) );
+		    __m128i const bit = _mm_set1_epi8( char( 1 << ( color & 7 ) ) );
+		    planes[ color >> 3 ] = _mm_or_si128( planes[ color >> 3 ], _mm_andnot_si128( _mm_cmpeq_epi8( mask, zero ), bit ) );
+		  }
+		
+		storePlanes( planes, out + idx );
+	      }
+#endif
+	    
+	    for(; idx < cols; ++idx )
+	      {
+		__Word value = 0;
+		for(unsigned int color = 0; color < masks.size(); ++color )
+		  {
+		    if( in[color][idx] )
+		      value |= __Word(1) << color;
+		  }
+		out[idx] = value;
+	      }
+	  }
+      }
+
+    /// @return true if any pixel in the region has a bit of key set
+    template<class __Word>
+      bool testRegion( cv::Mat const & encoded, __Word const & key )
+      {
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    __Word const * in = encoded.ptr<__Word>( idy );
+	    for(int idx = 0; idx < encoded.cols; ++idx )
+	      if( in[idx] & key )
+		return true;
+	  }
+	return false;
+      }
+
+    template<class __Word>
+      int countRegion( cv::Mat const & encoded, __Word const & key )
+      {
+	int count = 0;
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    __Word const * in = encoded.ptr<__Word>( idy );
+	    for(int idx = 0; idx < encoded.cols; ++idx )
+	      count += ( in[idx] & key ) ? 1 : 0;
+	  }
+	return count;
+      }
+
+    /// @return The OR of every pixel, i.e. a mask of every color that appears anywhere
+    template<class __Word>
+      uint64_t reduceOr( cv::Mat const & encoded )
+      {
+	__Word present = 0;
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    __Word const * in = encoded.ptr<__Word>( idy );
+	    for(int idx = 0; idx < encoded.cols; ++idx )
+	      present |= in[idx];
+	  }
+	return present;
+      }
+
+    template<class __Word>
+      void decodeBit( cv::Mat const & encoded, unsigned int const & bit, cv::Mat & mask )
+      {
+	__Word const key = __Word(1) << bit;
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    __Word const * in = encoded.ptr<__Word>( idy );
+	    unsigned char * out = mask.ptr<unsigned char>( idy );
+	    for(int idx = 0; idx < encoded.cols; ++idx )
+	      out[idx] = ( in[idx] & key ) ? 255 : 0;
+	  }
+      }
+
+    template<class __Word>
+      void appendRun( __Word const & value, int const & length, std::vector<uint16_t> & lengths, std::vector<uint8_t> & values )
+      {
+	lengths.push_back( length );
+	for(unsigned int byte = 0; byte < sizeof(__Word); ++byte )
+	  values.push_back( ( value >> ( 8 * byte ) ) & 0xff );
+      }
+    
+    /** 
+     * Append the runs of one row. Runs can't be longer than the row, so cols must fit in a uint16.
+     */
+    template<class __Word>
+      void encodeRowRuns( __Word const * row, int const & cols, std::vector<uint16_t> & lengths, std::vector<uint8_t> & values )
+      {
+	if( cols <= 0 )
+	  return;
+	
+	int run_start = 0;
+	int idx = 1;
+	while( idx < cols )
+	  {
+#ifdef __SSE2__
+	    /// Masks are mostly long runs, so skip a vector at a time while every word equals its left neighbor
+	    int const step = 16 / sizeof(__Word);
+	    while( idx + step <= cols && 
+		   _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( reinterpret_cast<__m128i const *>( row + idx ) ),
+						      _mm_loadu_si128( reinterpret_cast<__m128i const *>( row + idx - 1 ) ) ) ) == 0xFFFF )
+	      idx += step;
+	    
+	    if( idx >= cols )
+	      break;
+#endif
+	    if( row[idx] != row[ idx - 1 ] )
+	      {
+		appendRun( row[ idx - 1 ], idx - run_start, lengths, values );
+		run_start = idx;
+	      }
+	    ++idx;
+	  }
+	
+	appendRun( row[ cols - 1 ], cols - run_start, lengths, values );
+      }
+
+#ifdef __SSE2__
+    inline __m128i splat( uint16_t const & value ) { return _mm_set1_epi16( value ); }
+    inline __m128i splat( uint32_t const & value ) { return _mm_set1_epi32( value ); }
+    inline __m128i splat( uint64_t const & value ) { return _mm_set1_epi64x( value ); }
+#endif
+
+    template<class __Word>
+      void fillWords( __Word * out, __Word const & value, int const & length )
+      {
+	int idx = 0;
+#ifdef __SSE2__
+	int const step = 16 / sizeof(__Word);
+	if( length >= step )
+	  {
+	    __m128i const values = splat( value );
+	    for(; idx + step <= length; idx += step )
+	      _mm_storeu_si128( reinterpret_cast<__m128i *>( out + idx ), values );
+	  }
+#endif
+	for(; idx < length; ++idx )
+	  out[idx] = value;
+      }
+
+    /** 
+     * Expand the runs of one row
+     * 
+     * @return 0 on success, -1 if the runs don't add up to exactly cols pixels
+     */
+    template<class __Word>
+      int decodeRowRuns( uint16_t const * lengths, uint8_t const * values, unsigned int const & runs, __Word * row, int const & cols )
+      {
+	int idx = 0;
+	for(unsigned int run = 0; run < runs; ++run, values += sizeof(__Word) )
+	  {
+	    __Word value = 0;
+	    for(unsigned int byte = 0; byte < sizeof(__Word); ++byte )
+	      value |= __Word( values[byte] ) << ( 8 * byte );
+	    
+	    int const length = lengths[run];
+	    if( idx + length > cols )
+	      return -1;
+	    
+	    fillWords( row + idx, value, length );
+	    idx += length;
+	  }
+	return ( idx == cols ) ? 0 : -1;
+      }
+
+    template<class __Word>
+      int encodeRunLengths( cv::Mat const & encoded, auv_msgs::ColorEncodedImage & msg, size_t const & max_bytes )
+      {
+	msg.row_starts.resize( encoded.rows + 1 );
+	msg.run_lengths.clear();
+	msg.run_values.clear();
+	
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    msg.row_starts[ idy ] = msg.run_lengths.size();
+	    encodeRowRuns( encoded.ptr<__Word>( idy ), encoded.cols, msg.run_lengths, msg.run_values );
+
+	    if( msg.run_lengths.size() * sizeof(uint16_t) + msg.run_values.size() > max_bytes )
+	      return -1;
+	  }
+	msg.row_starts[ encoded.rows ] = msg.run_lengths.size();
+	return 0;
+      }
+
+    template<class __Word>
+      int decodeRunLengths( auv_msgs::ColorEncodedImage const & msg, cv::Mat & encoded )
+      {
+	for(int idy = 0; idy < encoded.rows; ++idy )
+	  {
+	    uint32_t const begin = msg.row_starts[ idy ], end = msg.row_starts[ idy + 1 ];
+	    if( end < begin || end > msg.run_lengths.size() )
+	      return -1;
+
+	    if( decodeRowRuns( msg.run_lengths.data() + begin, msg.run_values.data() + begin * sizeof(__Word), 
+			       end - begin, encoded.ptr<__Word>( idy ), encoded.cols ) )
+	      return -1;
+	  }
+	return 0;
+      }
+  } // color_codec
+
+  /** 
+   * Pack up to COLOR_CODEC_MAX_COLORS masks into one encoded image
+   * 
+   * @param masks CV_8UC1 masks of equal size, non-zero where the color is present. Bit i of the output comes from masks[i].
+   * @param encoded Output image in the narrowest layout that holds every mask
+   */
+  inline void packColorMasks( std::vector<cv::Mat> const & masks, cv::Mat & encoded )
+  {
+    ROS_ASSERT( !masks.empty() && masks.size() <= COLOR_CODEC_MAX_COLORS );
+    for( cv::Mat const & mask : masks )
+      ROS_ASSERT( mask.type() == CV_8UC1 && mask.size() == masks.front().size() );
+
+    encoded.create( masks.front().size(), getColorCodecCvType( masks.size() ) );
+
+    switch( encoded.elemSize() )
+      {
+      case 2: color_codec::packMasks<uint16_t>( masks, encoded ); break;
+      case 4: color_codec::packMasks<uint32_t>( masks, encoded ); break;
+      default: color_codec::packMasks<uint64_t>( masks, encoded ); break;
+      }
+  }
+
+  /** 
+   * Fill in the run-length fields of msg. image.data is left alone.
+   * 
+   * @param encoded Image in any color codec layout
+   * @param max_bytes Give up once the runs take more than this many bytes
+   * @return 0 on success, -1 if the image is too wide for uint16 runs or the runs exceeded max_bytes
+   */
+  inline int encodeRunLengths( cv::Mat const & encoded, auv_msgs::ColorEncodedImage & msg, 
+			       size_t const & max_bytes = std::numeric_limits<size_t>::max() )
+  {
+    if( encoded.cols > std::numeric_limits<uint16_t>::max() )
+      return -1;
+    
+    switch( encoded.elemSize() )
+      {
+      case 2: return color_codec::encodeRunLengths<uint16_t>( encoded, msg, max_bytes );
+      case 4: return color_codec::encodeRunLengths<uint32_t>( encoded, msg, max_bytes );
+      default: return color_codec::encodeRunLengths<uint64_t>( encoded, msg, max_bytes );
+      }
+  }
+
+  /** 
+   * Expand the run-length fields of msg
+   * 
+   * @param encoded Output image in the layout given by msg.image.encoding
+   * @return 0 on success, -1 if the message is malformed
+   */
+  inline int decodeRunLengths( auv_msgs::ColorEncodedImage const & msg, cv::Mat & encoded )
+  {
+    if( !getColorCodecCapacity( msg.image.encoding ) )
+      return -1;
+    
+    int const type = cv_bridge::getCvType( msg.image.encoding );
+    size_t const word_size = CV_ELEM_SIZE( type );
+    
+    if( msg.row_starts.size() != msg.image.height + 1 || msg.run_values.size() != msg.run_lengths.size() * word_size ||
+	msg.row_starts.front() != 0 || msg.row_starts.back() != msg.run_lengths.size() )
+      return -1;
+
+    encoded.create( msg.image.height, msg.image.width, type );
+    
+    switch( word_size )
+      {
+      case 2: return color_codec::decodeRunLengths<uint16_t>( msg, encoded );
+      case 4: return color_codec::decodeRunLengths<uint32_t>( msg, encoded );
+      default: return color_codec::decodeRunLengths<uint64_t>( msg, encoded );
+      }
+  }
+
+  /** 
+   * Pull a single color out of an encoded image
+   * 
+   * @param encoded Image in any color codec layout
+   * @param bit Index of the color
+   * @param mask Output CV_8UC1 image, 255 where the color is present and 0 elsewhere
+   */
+  inline void decodeColorBit( cv::Mat const & encoded, unsigned int const & bit, cv::Mat & mask )
+  {
+    ROS_ASSERT( bit < 8 * encoded.elemSize() );
+    mask.create( encoded.size(), CV_8UC1 );
+
+    switch( encoded.elemSize() )
+      {
+      case 2: color_codec::decodeBit<uint16_t>( encoded, bit, mask ); break;
+      case 4: color_codec::decodeBit<uint32_t>( encoded, bit, mask ); break;
+      default: color_codec::decodeBit<uint64_t>( encoded, bit, mask ); break;
+      }
+  }
   
-  class ColorEncoder
+  /**
+   * Read-only view of a received encoded image. Nothing is decoded up front: the encoded buffer is shared with
+   * the message, single colors are decoded only when asked for, and regions can be tested without decoding at all.
+   */
+  class EncodedColorImage
   {
+  public:
+    typedef std::shared_ptr<EncodedColorImage> Ptr;
+    typedef std::shared_ptr<EncodedColorImage const> ConstPtr;
+    
   private:
-    cv::Mat image_;
+    /// Keeps the message, and therefore encoded_'s data, alive
+    cv_bridge::CvImageConstPtr source_;
+    cv::Mat encoded_;
     std::vector<std::string> names_;
-    unsigned int color_idx_;
+    std::map<std::string, unsigned int> bits_;
+    /// Set when the producer only classified regions_
+    bool regions_only_;
+    std::vector<cv::Rect> regions_;
+
+    /// Planes that have been decoded so far. Guarded by cache_mutex_ so that colors can be requested from multiple threads.
+    mutable std::mutex cache_mutex_;
+    mutable ColorImageMap planes_;
+    mutable bool present_valid_;
+    mutable uint64_t present_;
     
   public:
-  ColorEncoder(): color_idx_(0){}
+  EncodedColorImage( cv_bridge::CvImageConstPtr const & source, std::vector<std::string> const & names,
+		     bool const & regions_only = false, std::vector<cv::Rect> const & regions = std::vector<cv::Rect>() ):
+    source_( source ), encoded_( source->image ), names_( names ), regions_only_( regions_only ), regions_( regions ),
+      present_valid_( false ), present_( 0 )
+    {
+      ROS_ASSERT( names_.size() <= 8 * encoded_.elemSize() );
+      for(unsigned int bit = 0; bit < names_.size(); ++bit )
+	bits_[ names_[bit] ] = bit;
+    }
 
-    void addImage( cv::Mat const & input, std::string const & name)
+    std::vector<std::string> const & getNames() const
+    {
+      return names_;
+    }
+
+    /// Encoded image, in any of the color codec layouts
+    cv::Mat const & getEncoded() const
+    {
+      return encoded_;
+    }
+
+    int rows() const { return encoded_.rows; }
+    int cols() const { return encoded_.cols; }
+
+    /// @return true if the producer only classified getRegions() and left the rest of the image blank
+    bool isRegionsOnly() const
+    {
+      return regions_only_;
+    }
+
+    /// Regions that were classified, clipped to the image. Only meaningful if isRegionsOnly().
+    std::vector<cv::Rect> const & getRegions() const
+    {
+      return regions_;
+    }
+
+    bool hasColor( std::string const & name ) const
+    {
+      return bits_.count( name );
+    }
+
+    /// @return Mask with only this color's bit set, or 0 if the color isn't in the image
+    uint64_t getKey( std::string const & name ) const
+    {
+      std::map<std::string, unsigned int>::const_iterator bit_it = bits_.find( name );
+      return ( bit_it == bits_.end() ) ? 0 : uint64_t(1) << bit_it->second;
+    }
+
+    /// @return Mask of every color that is present in at least one pixel. Takes one pass over the image the first time it is called.
+    uint64_t getPresentColors() const
+    {
+      std::lock_guard<std::mutex> lock( cache_mutex_ );
+      if( !present_valid_ )
+	{
+	  switch( encoded_.elemSize() )
+	    {
+	    case 2: present_ = color_codec::reduceOr<uint16_t>( encoded_ ); break;
+	    case 4: present_ = color_codec::reduceOr<uint32_t>( encoded_ ); break;
+	    default: present_ = color_codec::reduceOr<uint64_t>( encoded_ ); break;
+	    }
+	  present_valid_ = true;
+	}
+      return present_;
+    }
+
+    bool isPresent( std::string const & name ) const
     {
-      /// Using 1 bit per color at a depth of 16 bits limits us to 16 colors
-      ROS_ASSERT( color_idx_ < 16 );
+      return getPresentColors() & getKey( name );
+    }
+
+    /** 
+     * Decode a single color into a caller owned buffer, which is safe to modify
+     * 
+     * @param mask Output CV_8UC1 image, 255 where the color is present and 0 elsewhere
+     * @return 0 on success, -1 if the color isn't in the image
+     */
+    int decodePlane( std::string const & name, cv::Mat & mask ) const
+    {
+      std::map<std::string, unsigned int>::const_iterator bit_it = bits_.find( name );
+      if( bit_it == bits_.end() )
+	return -1;
+      
+      decodeColorBit( encoded_, bit_it->second, mask );
+      return 0;
+    }
+
+    /** 
+     * Decode a single color inside a region only
+     * 
+     * @param mask Output CV_8UC1 image of region's size. May be a view into a larger image, which is written in place.
+     * @return 0 on success, -1 if the color isn't in the image
+     */
+    int decodePlane( std::string const & name, cv::Mat & mask, cv::Rect const & region ) const
+    {
+      std::map<std::string, unsigned int>::const_iterator bit_it = bits_.find( name );
+      if( bit_it == bits_.end() )
+	return -1;
       
-      if( image_.empty())
+      decodeColorBit( encoded_( region ), bit_it->second, mask );
+      return 0;
+    }
+
+    /// @return Decoded color, cached so that later calls are free. Empty if the color isn't in the image. Do not modify.
+    cv::Mat getPlane( std::string const & name ) const
+    {
+      std::lock_guard<std::mutex> lock( cache_mutex_ );
+      ColorImageMap::const_iterator plane_it = planes_.find( name );
+      if( plane_it != planes_.end() )
+	return plane_it->second;
+
+      cv::Mat plane;
+      if( decodePlane( name, plane ) )
+	return cv::Mat();
+      
+      planes_[ name ] = plane;
+      return plane;
+    }
+
+    /// @return true if any pixel of the color is inside region. Nothing is decoded.
+    bool testRegion( std::string const & name, cv::Rect const & region ) const
+    {
+      uint64_t const key = getKey( name );
+      cv::Mat const roi = encoded_( region & cv::Rect( 0, 0, encoded_.cols, encoded_.rows ) );
+      
+      switch( encoded_.elemSize() )
 	{
-	  image_ = cv::Mat( input.size(), cv_bridge::getCvType( COLOR_CODEC_IMAGE_TYPE ));
-	  image_.setTo(0);
+	case 2: return key && color_codec::testRegion<uint16_t>( roi, key );
+	case 4: return key && color_codec::testRegion<uint32_t>( roi, key );
+	default: return key && color_codec::testRegion<uint64_t>( roi, key );
 	}
-      cv::Mat encoded; input.copyTo(encoded); 
-      /// convert to mono16 before encoding so that mono8 images don't clip when image count exceeds 8
-      encoded.convertTo(encoded, CV_8UC1);
-      /// Set the pixels where encoded is non-zero to 2^color_idx
-      cv::add(image_, (1 << color_idx_), image_, encoded);
+    }
+
+    /// @return Number of pixels of the color inside region. Nothing is decoded.
+    int countRegion( std::string const & name, cv::Rect const & region ) const
+    {
+      uint64_t const key = getKey( name );
+      if( !key )
+	return 0;
+      
+      cv::Mat const roi = encoded_( region & cv::Rect( 0, 0, encoded_.cols, encoded_.rows ) );
+      
+      switch( encoded_.elemSize() )
+	{
+	case 2: return color_codec::countRegion<uint16_t>( roi, key );
+	case 4: return color_codec::countRegion<uint32_t>( roi, key );
+	default: return color_codec::countRegion<uint64_t>( roi, key );
+	}
+    }
+
+    /// Decode every color, for consumers that really need all of them
+    void decodeAll( ColorImageMap & planes ) const
+    {
+      for( std::string const & name : names_ )
+	planes[ name ] = getPlane( name );
+    }
+  };
+
+  typedef EncodedColorImage::Ptr EncodedColorImagePtr;
+  typedef EncodedColorImage::ConstPtr EncodedColorImageConstPtr;
+  
+  class ColorEncoder
+  {
+  private:
+    /// Packed on demand, so that every mask added with addImage() is packed in a single pass
+    mutable cv::Mat image_;
+    std::vector<cv::Mat> masks_;
+    std::vector<std::string> names_;
+    bool regions_only_;
+    std::vector<cv::Rect> regions_;
+    
+  public:
+  ColorEncoder(): regions_only_( false ) {}
+
+    /// Wrap an image that has already been encoded elsewhere. Bit i of each pixel corresponds to names[i].
+  ColorEncoder( cv::Mat const & encoded, std::vector<std::string> const & names ):
+    image_( encoded ), names_( names ), regions_only_( false )
+    {
+      ROS_ASSERT( names_.size() <= COLOR_CODEC_MAX_COLORS );
+      ROS_ASSERT( image_.type() == getColorCodecCvType( names_.size() ) );
+    }
+
+    /// The mask is referenced rather than copied, so it must not be modified until the encoder is published.
+    void addImage( cv::Mat const & input, std::string const & name)
+    {
+      /// Using 1 bit per color at a depth of 64 bits limits us to 64 colors
+      ROS_ASSERT( names_.size() < COLOR_CODEC_MAX_COLORS );
+      /// Can't add to an image that was encoded elsewhere
+      ROS_ASSERT( masks_.size() == names_.size() );
+
+      cv::Mat mask = input;
+      if( mask.type() != CV_8UC1 )
+	input.convertTo( mask, CV_8UC1 );
+      
+      masks_.push_back( mask );
       names_.push_back(name);
-      ++color_idx_;
+      image_.release();
+    }
+
+    cv::Mat const & getImage() const
+    {
+      if( image_.empty() && !masks_.empty() )
+	packColorMasks( masks_, image_ );
+      return image_;
+    }
+
+    std::vector<std::string> const & getNames() const
+    {
+      return names_;
+    }
+
+    std::string getImageType() const
+    {
+      return getColorCodecImageType( names_.size() );
     }
 
-    friend class EncodedColorPublisher;
+    /// Mark the image as classified only inside regions, with everything else left blank. Published with the image so that consumers search the same regions.
+    void setRegions( std::vector<cv::Rect> const & regions )
+    {
+      regions_only_ = true;
+      regions_ = regions;
+    }
+
+    bool isRegionsOnly() const
+    {
+      return regions_only_;
+    }
+
+    std::vector<cv::Rect> const & getRegions() const
+    {
+      return regions_;
+    }
   };
   
   class EncodedColorPublisher
   {
+  public:
+    enum class Format
+    {
+      DENSE,
+      /// Run-length encode every row. Much smaller for sparse masks.
+      RLE,
+      /// Whichever of DENSE and RLE is smaller for each frame
+      AUTO
+    };
+    
   private:
     ros::Publisher pub_;
+    Format format_;
 
   public:
+  EncodedColorPublisher(): format_( Format::DENSE ) {}
+    
     void advertise( ros::NodeHandle nh, std::string const & topic, int const & queue_size = 1)
     {
       pub_ = nh.advertise<auv_msgs::ColorEncodedImage>(topic, queue_size );
     }
+
+    void setFormat( Format const & format )
+    {
+      format_ = format;
+    }
+
+    /// @return 0 on success, -1 if name isn't one of { dense, rle, auto }
+    static int parseFormat( std::string const & name, Format & format )
+    {
+      if( name == "dense" )
+	format = Format::DENSE;
+      else if( name == "rle" )
+	format = Format::RLE;
+      else if( name == "auto" )
+	format = Format::AUTO;
+      else
+	return -1;
+      return 0;
+    }
     
     void publish( ColorEncoder const & encoder,  std_msgs::Header const & header)
     {
       auv_msgs::ColorEncodedImage msg;
-      cv_bridge::CvImage image_out(header, COLOR_CODEC_IMAGE_TYPE, encoder.image_ );
-      image_out.toImageMsg(msg.image);
-      msg.encoding = encoder.names_;
+      msg.encoding = encoder.getNames();
+
+      msg.regions_only = encoder.isRegionsOnly();
+      for( cv::Rect const & rect : encoder.getRegions() )
+	{
+	  auv_msgs::ImageRegion region;
+	  region.x = rect.x;
+	  region.y = rect.y;
+	  region.width = rect.width;
+	  region.height = rect.height;
+	  msg.regions.push_back( region );
+	}
+      
+      cv::Mat const & image = encoder.getImage();
+      size_t const dense_bytes = image.total() * image.elemSize();
+      size_t const max_bytes = ( format_ == Format::AUTO ) ? dense_bytes : std::numeric_limits<size_t>::max();
+
+      if( format_ != Format::DENSE && !encodeRunLengths( image, msg, max_bytes ) )
+	{
+	  msg.format = auv_msgs::ColorEncodedImage::FORMAT_RLE;
+	  msg.image.header = header;
+	  msg.image.encoding = encoder.getImageType();
+	  msg.image.height = image.rows;
+	  msg.image.width = image.cols;
+	  msg.image.is_bigendian = 0;
+	  msg.image.step = 0;
+	}
+      else
+	{
+	  msg.format = auv_msgs::ColorEncodedImage::FORMAT_DENSE;
+	  msg.row_starts.clear();
+	  msg.run_lengths.clear();
+	  msg.run_values.clear();
+	  
+	  cv_bridge::CvImage image_out(header, encoder.getImageType(), image );
+	  image_out.toImageMsg(msg.image);
+	}
+      
       pub_.publish( msg );
 
     }
@@ -118,7 +828,7 @@ namespace uscauv
   private:
     
     ros::Subscriber sub_;
-    std::function< void( ColorImageMapPtr const &, std_msgs::Header const &)> external_callback;
+    std::function< void( EncodedColorImageConstPtr const &, std_msgs::Header const &)> external_callback;
 
   public:
     template<class... __BoundArgs>
@@ -133,19 +843,53 @@ namespace uscauv
   private:
     void decode( auv_msgs::ColorEncodedImage::ConstPtr const & msg)
     {
-      ColorImageMapPtr decoded = std::make_shared<ColorImageMap>();
+      if( msg->encoding.size() > getColorCodecCapacity( msg->image.encoding ) )
+	{
+	  ROS_WARN_THROTTLE( 1, "Encoded image [ %s ] can't hold [ %lu ] colors. Dropping...", 
+			     msg->image.encoding.c_str(), msg->encoding.size() );
+	  return;
+	}
       
-      unsigned int color_idx = 0;
-      for(std::vector<std::string>::const_iterator name_it = msg->encoding.begin();
-	  name_it != msg->encoding.end(); ++name_it, ++color_idx)
+      /// The encoded buffer is shared with the message rather than copied. Colors are only decoded when the consumer asks.
+      cv_bridge::CvImageConstPtr encoded;
+      if( msg->format == auv_msgs::ColorEncodedImage::FORMAT_RLE )
 	{
-	  cv::Mat output = cv_bridge::toCvCopy( msg->image, COLOR_CODEC_IMAGE_TYPE )->image;
-	  cv::bitwise_and(output, (1 << color_idx) , output);
-	  /* ROS_DEBUG("Decoding with key %d", (1 << color_idx)); */
-	  output.convertTo( output, CV_8UC1 );
-	  output.setTo( 255, output );
-	  decoded->insert( std::pair<std::string, cv::Mat>( *name_it, output ));
+	  cv_bridge::CvImagePtr expanded = boost::make_shared<cv_bridge::CvImage>();
+	  expanded->header = msg->image.header;
+	  expanded->encoding = msg->image.encoding;
+	  if( decodeRunLengths( *msg, expanded->image ) )
+	    {
+	      ROS_WARN_THROTTLE( 1, "Malformed run-length encoded image. Dropping..." );
+	      return;
+	    }
+	  encoded = expanded;
 	}
+      else
+	{
+	  try
+	    {
+	      encoded = cv_bridge::toCvShare( msg->image, msg );
+	    }
+	  catch( cv_bridge::Exception & e )
+	    {
+	      ROS_ERROR( "cv_bridge exception: %s", e.what() );
+	      return;
+	    }
+	}
+      
+      std::vector<cv::Rect> regions;
+      if( msg->regions_only )
+	{
+	  cv::Rect const frame( 0, 0, encoded->image.cols, encoded->image.rows );
+	  for( auv_msgs::ImageRegion const & region : msg->regions )
+	    {
+	      cv::Rect const rect = cv::Rect( region.x, region.y, region.width, region.height ) & frame;
+	      if( rect.area() > 0 )
+		regions.push_back( rect );
+	    }
+	}
+      
+      EncodedColorImageConstPtr decoded = std::make_shared<EncodedColorImage>( encoded, msg->encoding, msg->regions_only, regions );
       
       if( external_callback )
 	external_callback( decoded, msg->image.header );
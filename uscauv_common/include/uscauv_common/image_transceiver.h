@@ -47,6 +47,8 @@
 
 /// cpp11
 #include <functional>
+#include <algorithm>
+#include <map>
 
 class ImageTransceiver
 {
@@ -56,12 +58,21 @@ class ImageTransceiver
   typedef std::map<std::string, image_transport::Publisher> _NamedPublisherMap;
   typedef std::map<std::string, image_transport::Subscriber> _NamedSubscriberMap;
   typedef std::map<std::string,  _ImageCBFunction> _NamedCallbackMap;
+
+  /// Bookkeeping for publishImageLazy()
+  struct LazyPublishState
+  {
+    unsigned int decimation_;
+    uint64_t frames_;
+  };
+  typedef std::map<std::string, LazyPublishState> _NamedLazyStateMap;
   
   ros::NodeHandle nh_rel_;
   image_transport::ImageTransport image_transport_;
   _NamedPublisherMap  publishers_;
   _NamedSubscriberMap subscribers_;
   _NamedCallbackMap callbacks_;
+  _NamedLazyStateMap lazy_states_;
 
  public:
 
@@ -88,6 +99,11 @@ class ImageTransceiver
       }
 
     publishers_[ topic_resolved ] = image_transport_.advertise( topic_rel, queue_size, latch );
+
+    /// Debug images are often far more expensive to draw than they are worth at full rate. See publishImageLazy().
+    LazyPublishState & lazy_state = lazy_states_[ topic_resolved ];
+    lazy_state.decimation_ = std::max( 1, nh_rel_.param<int>( "image_decimation", 1 ) );
+    lazy_state.frames_ = 0;
     
     ROS_INFO("Created publisher successfully.");
 
@@ -202,6 +218,70 @@ class ImageTransceiver
   }
 
   
+  /// @return true if anyone is subscribed to the topic
+  bool hasImageSubscribers( std::string const & topic_rel ) const
+  {
+    _NamedPublisherMap::const_iterator pub_it = publishers_.find( nh_rel_.resolveName( topic_rel, true ) );
+    return pub_it != publishers_.end() && pub_it->second.getNumSubscribers() > 0;
+  }
+
+  /** 
+   * Only render every decimation-th frame for publishImageLazy(). Defaults to ~image_decimation, or 1.
+   */
+  void setImageDecimation( std::string const & topic_rel, unsigned int const & decimation )
+  {
+    std::string const & topic_resolved = nh_rel_.resolveName( topic_rel, true);
+
+    _NamedLazyStateMap::iterator state_it = lazy_states_.find( topic_resolved );
+    if( state_it == lazy_states_.end() )
+      {
+	ROS_WARN("Requested decimation for topic [ %s ], which has not been advertised.", topic_resolved.c_str() );
+	return;
+      }
+    state_it->second.decimation_ = std::max( 1u, decimation );
+  }
+
+  /** 
+   * Call once per frame for each lazily published topic. Counts the frame towards the topic's decimation.
+   * Use this instead of publishImageLazy() when the image has to be rendered somewhere other than at the point where it is published.
+   * 
+   * @return true if this frame's image should be rendered and published, i.e. someone is subscribed and the frame isn't decimated
+   */
+  bool shouldRenderImage( std::string const & topic_rel )
+  {
+    std::string const & topic_resolved = nh_rel_.resolveName( topic_rel, true);
+
+    _NamedLazyStateMap::iterator state_it = lazy_states_.find( topic_resolved );
+    _NamedPublisherMap::const_iterator pub_it = publishers_.find( topic_resolved );
+    if( state_it == lazy_states_.end() || pub_it == publishers_.end() )
+      return false;
+
+    LazyPublishState & state = state_it->second;
+    bool const decimated = ( state.frames_++ % state.decimation_ ) != 0;
+    
+    return !decimated && pub_it->second.getNumSubscribers() > 0;
+  }
+
+  /** 
+   * Call render and publish its image, but only if shouldRenderImage() says so. Keeps debug drawing free when
+   * nobody is looking.
+   * 
+   * @param topic_rel Topic to publish to, relative to node namespace
+   * @param render Callable with no arguments that returns the image to publish, as a cv_bridge::CvImage::ConstPtr
+   * 
+   * @return true if the image was rendered
+   */
+  template<class __Render>
+    bool publishImageLazy( std::string const & topic_rel, __Render && render )
+  {
+    if( !shouldRenderImage( topic_rel ) )
+      return false;
+
+    cv_bridge::CvImage::ConstPtr const image = render();
+    publishImage( topic_rel, image );
+    return true;
+  }
+  
   void publishImage(std::string const & topic_rel, sensor_msgs::ImagePtr const & image ) const
   {
     /// Get full publisher topic. 
@@ -0,0 +1,210 @@
+/***************************************************************************
+ *  include/uscauv_common/region_scheduler.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, Dylan Foster (turtlecannon@gmail.com)
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_USCAUVCOMMON_REGIONSCHEDULER
+#define USCAUV_USCAUVCOMMON_REGIONSCHEDULER
+
+// ROS
+#include <ros/ros.h>
+
+// uscauv
+#include <uscauv_common/param_loader.h>
+
+// messages
+#include <auv_msgs/ImageRegionArray.h>
+
+// opencv
+#include <opencv2/core/core.hpp>
+
+// cpp11
+#include <mutex>
+
+namespace uscauv
+{
+  /**
+   * Decides, frame by frame, whether a vision node should scan the whole image or only the regions where
+   * the object tracker expects objects to be. Every full_scan_interval-th frame is a full scan so that new
+   * objects are found, as is every frame while the tracker's regions are missing or stale.
+   *
+   * Only the first stage of a pipeline should own a scheduler. Later stages follow the decision that it
+   * publishes with its output (e.g. ColorEncodedImage::regions_only), so that every stage full-scans the same frames.
+   *
+   * Regions may arrive on a different thread than frames are processed on.
+   */
+  class RegionScheduler
+  {
+  private:
+    ros::Subscriber sub_;
+    
+    std::mutex regions_mutex_;
+    auv_msgs::ImageRegionArray::ConstPtr regions_;
+
+    /// 0 disables region mode, so every frame is a full scan
+    int full_scan_interval_;
+    double timeout_;
+    unsigned int frame_count_;
+    
+  public:
+  RegionScheduler(): full_scan_interval_( 0 ), timeout_( 0.5 ), frame_count_( 0 ) {}
+
+    /** 
+     * Load ~full_scan_interval and ~region_timeout, and subscribe to ~image_regions if region mode is enabled
+     * 
+     * @param nh_rel Private node handle of the vision node
+     */
+    void init( ros::NodeHandle & nh_rel )
+    {
+      /// Scan the whole image once every this many frames. 0 scans the whole image every frame.
+      full_scan_interval_ = std::max( 0, uscauv::param::load<int>( nh_rel, "full_scan_interval", 0 ) );
+      /// Regions older than this many seconds are ignored
+      timeout_ = uscauv::param::load<double>( nh_rel, "region_timeout", 0.5 );
+
+      if( full_scan_interval_ )
+	{
+	  sub_ = nh_rel.subscribe( "image_regions", 1, &RegionScheduler::regionCallback, this );
+	  ROS_INFO( "Processing tracker regions, with a full scan every [ %d ] frames.", full_scan_interval_ );
+	}
+    }
+
+    bool isEnabled() const
+    {
+      return full_scan_interval_;
+    }
+
+    /** 
+     * Call once per frame
+     * 
+     * @param image_size Size of the image being processed. Regions are scaled to it.
+     * @param padding Pixels to grow each region by, e.g. for filter kernels that need context
+     * @param regions Output non-overlapping regions, clipped to the image. Only valid if this returns true.
+     * 
+     * @return true if only regions should be processed this frame, false for a full scan
+     */
+    bool getRegions( cv::Size const & image_size, int const & padding, std::vector<cv::Rect> & regions )
+    {
+      if( !full_scan_interval_ )
+	return false;
+
+      /// Always start with a full scan
+      bool const full_scan = ( frame_count_++ % full_scan_interval_ ) == 0;
+      
+      auv_msgs::ImageRegionArray::ConstPtr latest;
+      {
+	std::lock_guard<std::mutex> lock( regions_mutex_ );
+	latest = regions_;
+      }
+
+      if( full_scan || !latest || !latest->image_rows || !latest->image_cols ||
+	  ( ros::Time::now() - latest->header.stamp ).toSec() > timeout_ )
+	return false;
+      
+      double const scale_x = double( image_size.width ) / latest->image_cols;
+      double const scale_y = double( image_size.height ) / latest->image_rows;
+      
+      regions.clear();
+      for( auv_msgs::ImageRegion const & region : latest->regions )
+	{
+	  int const x0 = std::floor( region.x * scale_x ), y0 = std::floor( region.y * scale_y );
+	  int const x1 = std::ceil( ( region.x + region.width ) * scale_x );
+	  int const y1 = std::ceil( ( region.y + region.height ) * scale_y );
+	  regions.push_back( cv::Rect( x0, y0, x1 - x0, y1 - y0 ) );
+	}
+      
+      padRegions( image_size, padding, regions );
+      return true;
+    }
+
+    /** 
+     * Grow regions, clip them to the image, drop empty ones and merge the ones that now overlap
+     * 
+     * @param image_size Size of the image that regions are in
+     * @param padding Pixels to grow each region by
+     * @param regions Regions to update in place
+     */
+    static void padRegions( cv::Size const & image_size, int const & padding, std::vector<cv::Rect> & regions )
+    {
+      cv::Rect const frame( 0, 0, image_size.width, image_size.height );
+
+      std::vector<cv::Rect> padded;
+      padded.reserve( regions.size() );
+      for( cv::Rect const & region : regions )
+	{
+	  cv::Rect const rect = cv::Rect( region.x - padding, region.y - padding, 
+					  region.width + 2 * padding, region.height + 2 * padding ) & frame;
+	  if( rect.area() > 0 )
+	    padded.push_back( rect );
+	}
+
+      mergeOverlapping( padded );
+      regions.swap( padded );
+    }
+
+    /// Replace overlapping rectangles with their bounding boxes until none overlap, so that regions can be processed concurrently
+    static void mergeOverlapping( std::vector<cv::Rect> & rects )
+    {
+      bool merged = true;
+      while( merged )
+	{
+	  merged = false;
+	  for(unsigned int first = 0; first < rects.size() && !merged; ++first )
+	    {
+	      for(unsigned int second = first + 1; second < rects.size(); ++second )
+		{
+		  if( ( rects[first] & rects[second] ).area() > 0 )
+		    {
+		      rects[first] = rects[first] | rects[second];
+		      rects.erase( rects.begin() + second );
+		      merged = true;
+		      break;
+		    }
+		}
+	    }
+	}
+    }
+    
+  private:
+    void regionCallback( auv_msgs::ImageRegionArray::ConstPtr const & msg )
+    {
+      std::lock_guard<std::mutex> lock( regions_mutex_ );
+      regions_ = msg;
+    }
+  };
+  
+} // uscauv
+
+#endif // USCAUV_USCAUVCOMMON_REGIONSCHEDULER
@@ -0,0 +1,226 @@
+/***************************************************************************
+ *  include/uscauv_common/worker_pool.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, Dylan Foster (turtlecannon@gmail.com)
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_USCAUVCOMMON_WORKERPOOL
+#define USCAUV_USCAUVCOMMON_WORKERPOOL
+
+/// cpp11
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <deque>
+
+namespace uscauv
+{
+
+  /**
+   * Fixed-size pool of worker threads. Work is submitted as a batch of tasks, and the caller blocks
+   * on a single completion barrier until every task in the batch has finished. While it waits, the
+   * calling thread helps drain the queue, so a pool of size N keeps N+1 cores busy.
+   *
+   * Batches from different threads can be in flight at the same time; each caller only waits on its own.
+   */
+  class WorkerPool
+  {
+  public:
+    typedef std::function<void()> TaskType;
+
+  private:
+    /// Completion barrier shared by all of the tasks in one batch
+    struct Batch
+    {
+      std::mutex m_;
+      std::condition_variable cv_;
+      unsigned int remaining_;
+    };
+    typedef std::shared_ptr<Batch> _BatchPtr;
+    typedef std::pair<TaskType, _BatchPtr> _QueuedTask;
+
+    std::vector<std::thread> workers_;
+    std::deque<_QueuedTask> tasks_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool running_;
+
+  public:
+    /**
+     * @param size Number of worker threads. If zero, one thread is spawned per hardware thread, minus
+     * one for the caller.
+     */
+  WorkerPool( unsigned int size = 0 ): running_( true )
+    {
+      if( !size )
+	{
+	  /// hardware_concurrency() is allowed to return 0 if it can't tell
+	  unsigned int const hardware_threads = std::thread::hardware_concurrency();
+	  size = ( hardware_threads > 1 ) ? hardware_threads - 1 : 1;
+	}
+
+      for(unsigned int idx = 0; idx < size; ++idx )
+	workers_.push_back( std::thread( &WorkerPool::workerThread, this ) );
+    }
+
+    ~WorkerPool()
+    {
+      {
+	std::lock_guard<std::mutex> lock( m_ );
+	running_ = false;
+      }
+      cv_.notify_all();
+
+      for( std::thread & worker : workers_ )
+	worker.join();
+    }
+
+    WorkerPool( WorkerPool const & ) = delete;
+    WorkerPool & operator=( WorkerPool const & ) = delete;
+
+    /// Number of worker threads, not counting callers that help out while they wait
+    unsigned int size() const
+    {
+      return workers_.size();
+    }
+
+    /** 
+     * Run every task, and return once all of them have finished.
+     */
+    void run( std::vector<TaskType> const & tasks )
+    {
+      if( tasks.empty() )
+	return;
+
+      _BatchPtr batch = std::make_shared<Batch>();
+      batch->remaining_ = tasks.size();
+
+      {
+	std::lock_guard<std::mutex> lock( m_ );
+	for( TaskType const & task : tasks )
+	  tasks_.push_back( std::make_pair( task, batch ) );
+      }
+      cv_.notify_all();
+
+      /// Work on our own (or anyone's) tasks instead of sleeping
+      while( true )
+	{
+	  _QueuedTask task;
+	  {
+	    std::lock_guard<std::mutex> lock( m_ );
+	    if( tasks_.empty() )
+	      break;
+	    task = tasks_.front();
+	    tasks_.pop_front();
+	  }
+	  execute( task );
+	}
+
+      std::unique_lock<std::mutex> lock( batch->m_ );
+      batch->cv_.wait( lock, [&]{ return batch->remaining_ == 0; } );
+    }
+
+    /** 
+     * Split the range [begin, end) into contiguous chunks and call func( chunk_begin, chunk_end ) for
+     * each of them on the pool. Returns once every chunk has been processed.
+     * 
+     * @param chunks Number of chunks to split the range into. If zero, a few chunks per thread are
+     * used so that uneven chunks still balance out.
+     */
+    void parallelFor( int const & begin, int const & end, 
+		      std::function<void(int, int)> const & func, unsigned int chunks = 0 )
+    {
+      int const range = end - begin;
+      if( range <= 0 )
+	return;
+
+      if( !chunks )
+	chunks = 4 * ( size() + 1 );
+
+      int const chunk_size = std::max( 1, ( range + int(chunks) - 1 ) / int(chunks) );
+
+      std::vector<TaskType> tasks;
+      for(int chunk_begin = begin; chunk_begin < end; chunk_begin += chunk_size )
+	{
+	  int const chunk_end = std::min( end, chunk_begin + chunk_size );
+	  tasks.push_back( std::bind( func, chunk_begin, chunk_end ) );
+	}
+
+      run( tasks );
+    }
+
+  private:
+    void execute( _QueuedTask const & task )
+    {
+      task.first();
+
+      _BatchPtr const & batch = task.second;
+      bool done;
+      {
+	std::lock_guard<std::mutex> lock( batch->m_ );
+	done = ( --batch->remaining_ == 0 );
+      }
+      if( done )
+	batch->cv_.notify_all();
+    }
+
+    void workerThread()
+    {
+      while( true )
+	{
+	  _QueuedTask task;
+	  {
+	    std::unique_lock<std::mutex> lock( m_ );
+	    cv_.wait( lock, [&]{ return !running_ || !tasks_.empty(); } );
+
+	    if( !running_ && tasks_.empty() )
+	      return;
+	    
+	    task = tasks_.front();
+	    tasks_.pop_front();
+	  }
+	  execute( task );
+	}
+    }
+    
+  };
+
+} // uscauv
+
+#endif // USCAUV_USCAUVCOMMON_WORKERPOOL